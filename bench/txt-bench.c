@@ -0,0 +1,58 @@
+/*
+ * SPDX-License-Identifier: MIT
+ * Copyright Joshua Watt <JPEWhacker@gmail.com>
+ */
+
+/*
+ * Measures TXT record parsing throughput for a typical client record, a
+ * typical host record and a record full of malformed entries.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "txt.h"
+
+#define DEFAULT_ITERATIONS (1000000)
+
+static void run(char const* label, AvahiStringList* txt, int iterations) {
+    struct txt_info info;
+    unsigned checksum = 0;
+    gint64 start = g_get_monotonic_time();
+
+    for (int i = 0; i < iterations; i++) {
+        txt_parse(txt, &info);
+        checksum += info.host_preference + info.invalid;
+    }
+
+    gint64 elapsed = MAX(g_get_monotonic_time() - start, 1);
+
+    printf("%-10s %8.1f ns/parse %12.0f parses/s (checksum %u)\n", label,
+           (double)elapsed * 1000 / iterations,
+           (double)iterations * G_USEC_PER_SEC / elapsed, checksum);
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    AvahiStringList* client =
+        avahi_string_list_new("v=1", "pref=2", "link=wired", NULL);
+    AvahiStringList* host =
+        avahi_string_list_new("v=1", "wad=freedm.wad", "cap=8", NULL);
+    AvahiStringList* bad = avahi_string_list_new(
+        "pref", "=2", "pref=two", "pref=99999999999", "cap=-1", "wad=",
+        "x-unknown=1", NULL);
+
+    if (iterations <= 0) {
+        iterations = DEFAULT_ITERATIONS;
+    }
+
+    run("client", client, iterations);
+    run("host", host, iterations);
+    run("malformed", bad, iterations);
+
+    avahi_string_list_free(client);
+    avahi_string_list_free(host);
+    avahi_string_list_free(bad);
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * SPDX-License-Identifier: MIT
+ * Copyright Joshua Watt <JPEWhacker@gmail.com>
+ */
+
+#include <errno.h>
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capability.h"
+
+#define CAPABILITY_CACHE_FILE "capability"
+#define CAPABILITY_CACHE_VERSION (1)
+// Each benchmark runs for about this long
+#define BENCH_TIME_US (100000)
+#define CPU_CHUNK (1 << 16)
+// Larger than the last level cache of any board we run on
+#define MEMORY_BUFFER_SIZE (8 * 1024 * 1024)
+// More RAM than this does not make a better host
+#define RAM_SCORE_LIMIT (4096)
+// Scores are rounded down to steps of 25%, far wider than the benchmark
+// noise between boards of the same model
+#define SCORE_STEP_PERCENT (125)
+#define SCORE_MIN_STEP (16)
+
+// Keeps the benchmark loops from being optimized away
+static uint32_t volatile bench_sink;
+
+static int bench_cpu(void) {
+    uint32_t x = 2463534242u;
+    uint64_t ops = 0;
+    gint64 start = g_get_monotonic_time();
+    gint64 elapsed;
+
+    do {
+        for (int i = 0; i < CPU_CHUNK; i++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+        }
+        ops += CPU_CHUNK;
+        elapsed = g_get_monotonic_time() - start;
+    } while (elapsed < BENCH_TIME_US);
+
+    bench_sink = x;
+    return ops / elapsed;
+}
+
+static int bench_memory(void) {
+    g_autofree char* src = g_malloc(MEMORY_BUFFER_SIZE);
+    g_autofree char* dst = g_malloc(MEMORY_BUFFER_SIZE);
+    uint64_t bytes = 0;
+    gint64 start;
+    gint64 elapsed;
+
+    // Fault the pages in so they are not part of the measurement
+    memset(src, 0x5a, MEMORY_BUFFER_SIZE);
+    memset(dst, 0, MEMORY_BUFFER_SIZE);
+
+    start = g_get_monotonic_time();
+    do {
+        memcpy(dst, src, MEMORY_BUFFER_SIZE);
+        src[bytes % MEMORY_BUFFER_SIZE]++;
+        bytes += MEMORY_BUFFER_SIZE;
+        elapsed = g_get_monotonic_time() - start;
+    } while (elapsed < BENCH_TIME_US);
+
+    bench_sink = dst[bytes % MEMORY_BUFFER_SIZE];
+    return bytes / elapsed;
+}
+
+static int ram_size(void) {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    if (pages < 0 || page_size < 0) {
+        return 0;
+    }
+    return (uint64_t)pages * page_size / (1024 * 1024);
+}
+
+static void compute_score(struct capability* cap) {
+    int raw =
+        cap->cpu + cap->memory / 10 + MIN(cap->ram, RAM_SCORE_LIMIT) / 16;
+    int score = SCORE_MIN_STEP;
+
+    if (raw < SCORE_MIN_STEP) {
+        cap->score = raw;
+        return;
+    }
+    while (score * SCORE_STEP_PERCENT / 100 <= raw) {
+        score = score * SCORE_STEP_PERCENT / 100;
+    }
+    cap->score = score;
+}
+
+/* Loads a cached measurement taken on the same hardware */
+static bool load_cache(char const* path, int cpus, struct capability* cap) {
+    g_autofree char* contents = NULL;
+    int version;
+    int cached_cpus;
+    struct capability cached;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return false;
+    }
+
+    if (sscanf(contents,
+               "oe-doom-capability %d\ncpus %d ram %d cpu %d memory %d",
+               &version, &cached_cpus, &cached.ram, &cached.cpu,
+               &cached.memory) != 5 ||
+        version != CAPABILITY_CACHE_VERSION) {
+        g_warning("Ignoring capability cache %s with unknown format", path);
+        return false;
+    }
+
+    if (cached_cpus != cpus || cached.ram != cap->ram || cached.cpu <= 0 ||
+        cached.memory <= 0) {
+        return false;
+    }
+
+    cap->cpu = cached.cpu;
+    cap->memory = cached.memory;
+    return true;
+}
+
+static void save_cache(char const* cache_dir, char const* path, int cpus,
+                       struct capability const* cap) {
+    g_autoptr(GError) error = NULL;
+    g_autofree char* contents = g_strdup_printf(
+        "oe-doom-capability %d\ncpus %d ram %d cpu %d memory %d\n",
+        CAPABILITY_CACHE_VERSION, cpus, cap->ram, cap->cpu, cap->memory);
+
+    if (g_mkdir_with_parents(cache_dir, 0755) < 0 ||
+        !g_file_set_contents(path, contents, -1, &error)) {
+        g_warning("Cannot write capability cache %s: %s", path,
+                  error ? error->message : g_strerror(errno));
+    }
+}
+
+void capability_measure(char const* cache_dir, bool save,
+                        struct capability* cap) {
+    g_autofree char* path =
+        g_build_filename(cache_dir, CAPABILITY_CACHE_FILE, NULL);
+    int cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+    memset(cap, 0, sizeof(*cap));
+    cap->ram = ram_size();
+
+    if (load_cache(path, cpus, cap)) {
+        g_print("Using cached capability benchmark\n");
+    } else {
+        gint64 start = g_get_monotonic_time();
+
+        cap->cpu = bench_cpu();
+        cap->memory = bench_memory();
+        g_print("Capability benchmark took %" G_GINT64_FORMAT " ms\n",
+                (g_get_monotonic_time() - start) / 1000);
+
+        if (save) {
+            save_cache(cache_dir, path, cpus, cap);
+        }
+    }
+
+    compute_score(cap);
+    g_print("Capability score %d (cpu %d Mops/s, memory %d MB/s, RAM %d MB)\n",
+            cap->score, cap->cpu, cap->memory, cap->ram);
+}
@@ -0,0 +1,36 @@
+/*
+ * SPDX-License-Identifier: MIT
+ * Copyright Joshua Watt <JPEWhacker@gmail.com>
+ */
+
+#ifndef CAPABILITY_H
+#define CAPABILITY_H
+
+#include <stdbool.h>
+
+/*
+ * How well this device can run the authoritative game, measured by a short
+ * startup benchmark. Higher is better. The score is rounded down to coarse
+ * steps, so boards of the same model score the same and other tie breakers
+ * (such as the round trip time) decide between them, while a different
+ * model lands in a different step.
+ */
+struct capability {
+    // Single core integer throughput, millions of operations per second
+    int cpu;
+    // Memory copy bandwidth in MB/s
+    int memory;
+    // Physical memory in MB
+    int ram;
+    int score;
+};
+
+/*
+ * Measures the capability of this device. The result is cached in cache_dir
+ * and reused on later boots as long as the hardware looks the same; save
+ * controls whether a new measurement is written back.
+ */
+void capability_measure(char const* cache_dir, bool save,
+                        struct capability* cap);
+
+#endif
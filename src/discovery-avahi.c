@@ -0,0 +1,877 @@
+/*
+ * SPDX-License-Identifier: MIT
+ * Copyright Joshua Watt <JPEWhacker@gmail.com>
+ */
+
+#include <assert.h>
+#include <avahi-client/client.h>
+#include <avahi-client/lookup.h>
+#include <avahi-client/publish.h>
+#include <avahi-common/alternative.h>
+#include <avahi-common/error.h>
+#include <avahi-glib/glib-watch.h>
+#include <glib.h>
+#include <stdio.h>
+
+#include "discovery.h"
+
+#define OPS_WINDOW_SECONDS (60)
+// Longest a re-sync waits for the browsers to report all services
+#define RESYNC_TIMEOUT_SECONDS (10)
+
+// What a service browser is looking for, passed as its userdata
+enum browse_role {
+    BROWSE_CLIENTS,
+    BROWSE_HOSTS,
+    BROWSE_ELIGIBLE_CLIENTS,
+};
+
+/*
+ * A resolver for a browsed service. Only one resolver is kept per service;
+ * duplicate NEW events are coalesced into it. The resolver stays alive until
+ * the service is removed so that TXT record changes are reported as further
+ * AVAHI_RESOLVER_FOUND events. Only resolvers that have not produced their
+ * first result count against max_resolvers.
+ */
+struct service_resolver {
+    AvahiServiceResolver* resolver;
+    bool found;
+    AvahiIfIndex interface;
+    AvahiProtocol protocol;
+    char* name;
+    char const* type;
+    char const* domain;
+};
+
+static struct discovery_options options;
+static struct discovery_callbacks const* callbacks;
+static GMainLoop* main_loop = NULL;
+
+static AvahiGLibPoll* glib_poll = NULL;
+static AvahiClient* avahi_client = NULL;
+static AvahiServiceBrowser* client_browser = NULL;
+static AvahiServiceBrowser* host_browser = NULL;
+static AvahiServiceBrowser* eligible_browser = NULL;
+static bool connected_before = false;
+
+/*
+ * After reconnecting to avahi-daemon the browsers report every service
+ * again. The re-sync ends once each browser has reported ALL_FOR_NOW and no
+ * resolves are outstanding, or after RESYNC_TIMEOUT_SECONDS.
+ */
+static struct resync {
+    bool active;
+    // Bit per browse_role that has not reported ALL_FOR_NOW yet
+    unsigned pending_browsers;
+    guint timeout_source;
+} resync;
+
+// Local services that should be published whenever the client is running
+static GList* published = NULL;
+
+static GHashTable* service_resolvers = NULL;
+// Clients reported without resolving them, so they can be reported again
+static GHashTable* unresolved_clients = NULL;
+static GQueue resolve_queue = G_QUEUE_INIT;
+static int resolves_in_flight = 0;
+
+static struct stats {
+    unsigned resolves_started;
+    unsigned resolves_queued;
+    unsigned resolves_coalesced;
+    unsigned resolves_cancelled;
+    unsigned resolves_skipped;
+    unsigned refreshes;
+    // Browsers, resolvers and entry group commits issued to avahi-daemon
+    unsigned mdns_ops;
+    unsigned reconnects;
+} stats;
+
+/* mDNS operations per minute, sampled once a minute */
+static struct ops_window {
+    guint source;
+    unsigned at_start;
+    unsigned last;
+    unsigned peak;
+} ops_window;
+
+static void create_service(AvahiClient* client, struct local_service* service);
+
+static guint service_resolver_hash(gconstpointer p) {
+    struct service_resolver const* r = p;
+    guint h = g_str_hash(r->name);
+
+    h = h * 31 + g_str_hash(r->type);
+    h = h * 31 + g_str_hash(r->domain);
+    h = h * 31 + (guint)r->interface;
+    h = h * 31 + (guint)r->protocol;
+    return h;
+}
+
+static gboolean service_resolver_equal(gconstpointer pa, gconstpointer pb) {
+    struct service_resolver const* a = pa;
+    struct service_resolver const* b = pb;
+
+    return a->interface == b->interface && a->protocol == b->protocol &&
+           (g_strcmp0(a->name, b->name) == 0) &&
+           (g_strcmp0(a->type, b->type) == 0) &&
+           (g_strcmp0(a->domain, b->domain) == 0);
+}
+
+static void service_resolver_free(struct service_resolver* sr) {
+    if (sr) {
+        if (sr->resolver) {
+            avahi_service_resolver_free(sr->resolver);
+        }
+        g_free(sr->name);
+        g_free(sr);
+    }
+}
+
+static void handle_collision(struct local_service* service) {
+    /* A service name collision with a remote service
+     * happened. Let's pick a new name */
+    char* n = avahi_alternative_service_name(service->name);
+    avahi_free(service->name);
+    service->name = n;
+    fprintf(stderr, "Service name collision, renaming service to '%s'\n",
+            service->name);
+    /* And recreate the services */
+    create_service(avahi_entry_group_get_client(service->backend_data),
+                   service);
+}
+
+static void entry_group_callback(AvahiEntryGroup* group,
+                                 AvahiEntryGroupState state,
+                                 AVAHI_GCC_UNUSED void* userdata) {
+    struct local_service* service = userdata;
+
+    /* Called whenever the entry group state changes */
+    switch (state) {
+        case AVAHI_ENTRY_GROUP_ESTABLISHED:
+            /* The entry group has been established successfully */
+            fprintf(stderr, "Service '%s' successfully established.\n",
+                    service->name);
+            break;
+        case AVAHI_ENTRY_GROUP_COLLISION:
+            handle_collision(service);
+            break;
+
+        case AVAHI_ENTRY_GROUP_FAILURE:
+            fprintf(stderr, "Entry group failure: %s\n",
+                    avahi_strerror(avahi_client_errno(
+                        avahi_entry_group_get_client(group))));
+            break;
+
+        case AVAHI_ENTRY_GROUP_UNCOMMITED:
+        case AVAHI_ENTRY_GROUP_REGISTERING:;
+    }
+}
+
+static void create_service(AvahiClient* client, struct local_service* service) {
+    AvahiEntryGroup* group = service->backend_data;
+
+    if (group == NULL) {
+        group = avahi_entry_group_new(client, entry_group_callback, service);
+        if (group == NULL) {
+            g_critical("avahi_entry_group_new() failed: %s\n",
+                       avahi_strerror(avahi_client_errno(client)));
+            return;
+        }
+        service->backend_data = group;
+    }
+
+    if (avahi_entry_group_is_empty(group)) {
+        g_print("Adding service '%s'\n", service->name);
+
+        int ret = avahi_entry_group_add_service_strlst(
+            group, service->interface, service->protocol, service->flags,
+            service->name, service->type, service->domain, service->host,
+            service->port, service->txt_records);
+
+        if (ret != 0) {
+            if (ret == AVAHI_ERR_COLLISION) {
+                avahi_entry_group_reset(group);
+                handle_collision(service);
+                return;
+            }
+
+            g_error("Failed to add %s service: %s\n", service->type,
+                    avahi_strerror(ret));
+            return;
+        }
+
+        if (service->subtype) {
+            ret = avahi_entry_group_add_service_subtype(
+                group, service->interface, service->protocol, service->flags,
+                service->name, service->type, service->domain,
+                service->subtype);
+            if (ret != 0) {
+                g_warning("Failed to add %s subtype: %s\n", service->subtype,
+                          avahi_strerror(ret));
+            }
+        }
+
+        stats.mdns_ops++;
+        ret = avahi_entry_group_commit(group);
+        if (ret != 0) {
+            g_warning("Failed to commit entry group: %s\n",
+                      avahi_strerror(ret));
+        }
+    }
+}
+
+static void stop_service(struct local_service* service) {
+    AvahiEntryGroup* group = service->backend_data;
+
+    if (group) {
+        g_print("Stopping service %s %s\n", service->name, service->type);
+        avahi_entry_group_reset(group);
+        avahi_entry_group_free(group);
+        service->backend_data = NULL;
+    }
+}
+
+static void resolve_callback(AvahiServiceResolver* r, AvahiIfIndex interface,
+                             AvahiProtocol protocol, AvahiResolverEvent event,
+                             const char* name, const char* type,
+                             const char* domain, const char* host_name,
+                             const AvahiAddress* address, uint16_t port,
+                             AvahiStringList* txt, AvahiLookupResultFlags flags,
+                             void* userdata);
+
+static void report_unresolved(AvahiIfIndex interface, AvahiProtocol protocol,
+                              char const* name, char const* type,
+                              char const* domain,
+                              AvahiLookupResultFlags flags);
+
+static void start_service_resolver(struct service_resolver* sr) {
+    AvahiLookupFlags flags = 0;
+
+    // Only the host's address is ever used
+    if (options.low_chatter && g_strcmp0(sr->type, CLIENT_SERVICE_NAME) == 0) {
+        flags |= AVAHI_LOOKUP_NO_ADDRESS;
+    }
+
+    /*
+     * Each instance is resolved to an address of the protocol it was found
+     * on, so a dual stack peer ends up with both IPv4 and IPv6 addresses
+     * rather than the same IPv4 address twice
+     */
+    sr->resolver = avahi_service_resolver_new(
+        avahi_client, sr->interface, sr->protocol, sr->name, sr->type,
+        sr->domain, sr->protocol, flags, resolve_callback, sr);
+
+    if (sr->resolver == NULL) {
+        g_warning("Failed to resolve service '%s': %s\n", sr->name,
+                  avahi_strerror(avahi_client_errno(avahi_client)));
+        g_hash_table_remove(service_resolvers, sr);
+        return;
+    }
+
+    resolves_in_flight++;
+    stats.resolves_started++;
+    stats.mdns_ops++;
+}
+
+static void start_queued_resolves(void) {
+    while (resolves_in_flight < options.max_resolvers &&
+           !g_queue_is_empty(&resolve_queue)) {
+        start_service_resolver(g_queue_pop_head(&resolve_queue));
+    }
+}
+
+static void request_resolve(AvahiIfIndex interface, AvahiProtocol protocol,
+                            char const* name, char const* type,
+                            char const* domain) {
+    struct service_resolver key = {
+        .interface = interface,
+        .protocol = protocol,
+        .name = (char*)name,
+        .type = type,
+        .domain = domain,
+    };
+
+    if (g_hash_table_contains(service_resolvers, &key)) {
+        g_debug("Coalescing resolve of '%s'\n", name);
+        stats.resolves_coalesced++;
+        return;
+    }
+
+    struct service_resolver* sr = g_new0(struct service_resolver, 1);
+    sr->interface = interface;
+    sr->protocol = protocol;
+    sr->name = g_strdup(name);
+    sr->type = g_intern_string(type);
+    sr->domain = g_intern_string(domain);
+    g_hash_table_add(service_resolvers, sr);
+
+    if (resolves_in_flight < options.max_resolvers) {
+        start_service_resolver(sr);
+    } else {
+        g_debug("Queueing resolve of '%s'\n", name);
+        stats.resolves_queued++;
+        g_queue_push_tail(&resolve_queue, sr);
+    }
+}
+
+static void end_resync(void) {
+    if (resync.timeout_source) {
+        g_source_remove(resync.timeout_source);
+        resync.timeout_source = 0;
+    }
+    resync.active = false;
+    callbacks->resync_end();
+}
+
+static gboolean on_resync_timeout(gpointer userdata) {
+    g_print("Re-sync with avahi-daemon timed out\n");
+    resync.timeout_source = 0;
+    end_resync();
+    return G_SOURCE_REMOVE;
+}
+
+static void maybe_end_resync(void) {
+    if (resync.active && !resync.pending_browsers && !resolves_in_flight &&
+        g_queue_is_empty(&resolve_queue)) {
+        end_resync();
+    }
+}
+
+/* Called when a resolver produces its first result, freeing its slot */
+static void resolve_found(struct service_resolver* sr) {
+    if (!sr->found) {
+        sr->found = true;
+        resolves_in_flight--;
+        start_queued_resolves();
+        maybe_end_resync();
+    }
+}
+
+/* Drops a resolver, e.g. because it failed or the service went away */
+static void finish_resolve(struct service_resolver* sr) {
+    if (sr->resolver == NULL) {
+        g_queue_remove(&resolve_queue, sr);
+    } else if (!sr->found) {
+        resolves_in_flight--;
+    }
+    g_hash_table_remove(service_resolvers, sr);
+
+    start_queued_resolves();
+    maybe_end_resync();
+}
+
+static void cancel_resolve(char const* name, char const* type,
+                           char const* domain, AvahiIfIndex interface,
+                           AvahiProtocol protocol) {
+    struct service_resolver key = {
+        .interface = interface,
+        .protocol = protocol,
+        .name = (char*)name,
+        .type = type,
+        .domain = domain,
+    };
+    struct service_resolver* sr = g_hash_table_lookup(service_resolvers, &key);
+
+    if (sr) {
+        if (!sr->found) {
+            g_debug("Cancelling resolve of '%s'\n", name);
+            stats.resolves_cancelled++;
+        }
+        finish_resolve(sr);
+    }
+}
+
+static void resolve_callback(AvahiServiceResolver* r, AvahiIfIndex interface,
+                             AvahiProtocol protocol, AvahiResolverEvent event,
+                             const char* name, const char* type,
+                             const char* domain, const char* host_name,
+                             const AvahiAddress* address, uint16_t port,
+                             AvahiStringList* txt, AvahiLookupResultFlags flags,
+                             void* userdata) {
+    struct service_resolver* sr = userdata;
+    assert(r);
+    /* Called whenever a service has been resolved successfully or timed out
+     */
+    switch (event) {
+        case AVAHI_RESOLVER_FAILURE:
+            g_warning(
+                "(Resolver) Failed to resolve service '%s' of type '%s' in "
+                "domain '%s': %s\n",
+                name, type, domain,
+                avahi_strerror(
+                    avahi_client_errno(avahi_service_resolver_get_client(r))));
+            finish_resolve(sr);
+            // Still count the client, as if it had not been resolved
+            if (options.low_chatter &&
+                g_strcmp0(type, CLIENT_SERVICE_NAME) == 0) {
+                report_unresolved(interface, protocol, name, type, domain,
+                                  0);
+            }
+            break;
+
+        case AVAHI_RESOLVER_FOUND: {
+            resolve_found(sr);
+
+            char a[AVAHI_ADDRESS_STR_MAX], *t;
+            g_debug("Service '%s' of type '%s' in domain '%s':\n", name, type,
+                    domain);
+            if (address) {
+                avahi_address_snprint(a, sizeof(a), address);
+            } else {
+                g_strlcpy(a, "no address", sizeof(a));
+            }
+            t = avahi_string_list_to_string(txt);
+            g_debug(
+                "\t%s:%u (%s)\n"
+                "\tTXT=%s\n"
+                "\tcookie is %u\n"
+                "\tis_local: %i\n"
+                "\tour_own: %i\n"
+                "\twide_area: %i\n"
+                "\tmulticast: %i\n"
+                "\tcached: %i\n",
+                host_name, port, a, t,
+                avahi_string_list_get_service_cookie(txt),
+                !!(flags & AVAHI_LOOKUP_RESULT_LOCAL),
+                !!(flags & AVAHI_LOOKUP_RESULT_OUR_OWN),
+                !!(flags & AVAHI_LOOKUP_RESULT_WIDE_AREA),
+                !!(flags & AVAHI_LOOKUP_RESULT_MULTICAST),
+                !!(flags & AVAHI_LOOKUP_RESULT_CACHED));
+            avahi_free(t);
+
+            struct discovery_record record = {
+                .interface = interface,
+                .protocol = protocol,
+                .name = name,
+                .type = type,
+                .domain = domain,
+                .hostname = host_name,
+                .address = address,
+                .port = port,
+                .txt = txt,
+                .flags = flags,
+            };
+            callbacks->resolved(&record);
+        } break;
+    }
+}
+
+/*
+ * Reports a browsed client without resolving it. It takes part in the
+ * election with no host preference, which is all a client that does not
+ * advertise HOST_ELIGIBLE_SUBTYPE can have.
+ */
+static void report_unresolved(AvahiIfIndex interface, AvahiProtocol protocol,
+                              char const* name, char const* type,
+                              char const* domain,
+                              AvahiLookupResultFlags flags) {
+    struct service_resolver key = {
+        .interface = interface,
+        .protocol = protocol,
+        .name = (char*)name,
+        .type = type,
+        .domain = domain,
+    };
+
+    // Already (being) resolved through the subtype browser
+    if (g_hash_table_contains(service_resolvers, &key)) {
+        return;
+    }
+
+    if (!g_hash_table_contains(unresolved_clients, &key)) {
+        struct service_resolver* sr = g_new0(struct service_resolver, 1);
+        sr->interface = interface;
+        sr->protocol = protocol;
+        sr->name = g_strdup(name);
+        sr->type = g_intern_string(type);
+        sr->domain = g_intern_string(domain);
+        g_hash_table_add(unresolved_clients, sr);
+    }
+
+    struct discovery_record record = {
+        .interface = interface,
+        .protocol = protocol,
+        .name = name,
+        .type = type,
+        .domain = domain,
+        .hostname = "",
+        .flags = flags,
+    };
+
+    stats.resolves_skipped++;
+    callbacks->resolved(&record);
+}
+
+static void browse_callback(AvahiServiceBrowser* b, AvahiIfIndex interface,
+                            AvahiProtocol protocol, AvahiBrowserEvent event,
+                            const char* name, const char* type,
+                            const char* domain, AvahiLookupResultFlags flags,
+                            void* userdata) {
+    enum browse_role role = GPOINTER_TO_INT(userdata);
+    assert(b);
+
+    // Subtype browsers report the subtype; resolve the base service
+    if (role == BROWSE_ELIGIBLE_CLIENTS) {
+        type = CLIENT_SERVICE_NAME;
+    }
+
+    if (event == AVAHI_BROWSER_NEW && !callbacks->interface_allowed(interface)) {
+        g_debug("(Browser) Ignoring '%s' on interface %d\n", name, interface);
+        return;
+    }
+
+    /* Called whenever a new services becomes available on the LAN or is
+     * removed from the LAN */
+    switch (event) {
+        case AVAHI_BROWSER_FAILURE:
+            g_warning("(Browser) %s\n",
+                      avahi_strerror(avahi_client_errno(
+                          avahi_service_browser_get_client(b))));
+            return;
+
+        case AVAHI_BROWSER_NEW:
+            g_debug("(Browser) NEW: service '%s' of type '%s' in domain '%s'\n",
+                    name, type, domain);
+            if (role == BROWSE_CLIENTS && options.low_chatter) {
+                report_unresolved(interface, protocol, name, type, domain,
+                                  flags);
+            } else {
+                request_resolve(interface, protocol, name, type, domain);
+            }
+            break;
+
+        case AVAHI_BROWSER_REMOVE:
+            g_debug(
+                "(Browser) REMOVE: service '%s' of type '%s' in domain '%s'\n",
+                name, type, domain);
+            cancel_resolve(name, type, domain, interface, protocol);
+            // The client itself is removed by the plain client browser
+            if (role != BROWSE_ELIGIBLE_CLIENTS) {
+                struct service_resolver key = {
+                    .interface = interface,
+                    .protocol = protocol,
+                    .name = (char*)name,
+                    .type = type,
+                    .domain = domain,
+                };
+
+                g_hash_table_remove(unresolved_clients, &key);
+                callbacks->removed(interface, protocol, name, type, domain);
+            }
+            break;
+
+        case AVAHI_BROWSER_ALL_FOR_NOW:
+        case AVAHI_BROWSER_CACHE_EXHAUSTED:
+            g_debug("(Browser) %s\n", event == AVAHI_BROWSER_CACHE_EXHAUSTED
+                                          ? "CACHE_EXHAUSTED"
+                                          : "ALL_FOR_NOW");
+            if (event == AVAHI_BROWSER_ALL_FOR_NOW) {
+                resync.pending_browsers &= ~(1u << role);
+                maybe_end_resync();
+            }
+            break;
+    }
+}
+
+static AvahiServiceBrowser* new_browser(char const* type,
+                                        enum browse_role role) {
+    AvahiServiceBrowser* browser = avahi_service_browser_new(
+        avahi_client, AVAHI_IF_UNSPEC, options.protocol, type, NULL, 0,
+        browse_callback, GINT_TO_POINTER(role));
+
+    if (browser == NULL) {
+        g_warning("Cannot browse for %s: %s", type,
+                  avahi_strerror(avahi_client_errno(avahi_client)));
+    }
+    stats.mdns_ops++;
+    return browser;
+}
+
+static gboolean on_ops_window(gpointer userdata) {
+    ops_window.last = stats.mdns_ops - ops_window.at_start;
+    ops_window.peak = MAX(ops_window.peak, ops_window.last);
+    ops_window.at_start = stats.mdns_ops;
+    return G_SOURCE_CONTINUE;
+}
+
+static void create_browsers(void) {
+    client_browser = new_browser(CLIENT_SERVICE_NAME, BROWSE_CLIENTS);
+    host_browser = new_browser(HOST_SERVICE_NAME, BROWSE_HOSTS);
+    if (options.low_chatter && options.can_host) {
+        eligible_browser =
+            new_browser(HOST_ELIGIBLE_SUBTYPE, BROWSE_ELIGIBLE_CLIENTS);
+    }
+}
+
+static void begin_resync(void) {
+    resync.active = true;
+    resync.pending_browsers = (1u << BROWSE_CLIENTS) | (1u << BROWSE_HOSTS);
+    if (options.low_chatter && options.can_host) {
+        resync.pending_browsers |= (1u << BROWSE_ELIGIBLE_CLIENTS);
+    }
+    resync.timeout_source = g_timeout_add_seconds(RESYNC_TIMEOUT_SECONDS,
+                                                  on_resync_timeout, NULL);
+    callbacks->resync_begin();
+}
+
+/*
+ * Frees everything that belongs to the client. The local services stay in
+ * the published list so they are registered again on the next connection.
+ */
+static void free_client(void) {
+    for (GList* l = published; l; l = l->next) {
+        struct local_service* service = l->data;
+        g_clear_pointer((AvahiEntryGroup**)&service->backend_data,
+                        avahi_entry_group_free);
+    }
+
+    g_queue_clear(&resolve_queue);
+    if (service_resolvers) {
+        g_hash_table_remove_all(service_resolvers);
+    }
+    if (unresolved_clients) {
+        g_hash_table_remove_all(unresolved_clients);
+    }
+    resolves_in_flight = 0;
+
+    if (resync.timeout_source) {
+        g_source_remove(resync.timeout_source);
+        resync.timeout_source = 0;
+    }
+    resync.active = false;
+
+    g_clear_pointer(&eligible_browser, avahi_service_browser_free);
+    g_clear_pointer(&host_browser, avahi_service_browser_free);
+    g_clear_pointer(&client_browser, avahi_service_browser_free);
+    g_clear_pointer(&avahi_client, avahi_client_free);
+}
+
+static void avahi_client_callback(AvahiClient* client, AvahiClientState state,
+                                  void* userdata);
+
+/*
+ * Connects to avahi-daemon. With AVAHI_CLIENT_NO_FAIL the client waits in
+ * AVAHI_CLIENT_CONNECTING if the daemon is not running yet.
+ */
+static bool connect_client(void) {
+    int error = 0;
+
+    avahi_client_new(avahi_glib_poll_get(glib_poll), AVAHI_CLIENT_NO_FAIL,
+                     avahi_client_callback, NULL, &error);
+    if (avahi_client == NULL) {
+        g_warning("Cannot create Avahi client: %s", avahi_strerror(error));
+        return false;
+    }
+    return true;
+}
+
+/* Callback for state changes on the Client */
+static void avahi_client_callback(AvahiClient* client, AvahiClientState state,
+                                  AVAHI_GCC_UNUSED void* userdata) {
+    // The first call happens before avahi_client_new() returns
+    avahi_client = client;
+
+    g_debug("Avahi Client State Change: %d", state);
+    switch (state) {
+        case AVAHI_CLIENT_S_RUNNING:
+            if (connected_before) {
+                g_print("Reconnected to avahi-daemon, re-syncing peers\n");
+                begin_resync();
+            }
+            connected_before = true;
+
+            create_browsers();
+            for (GList* l = published; l; l = l->next) {
+                create_service(client, l->data);
+            }
+            break;
+
+        case AVAHI_CLIENT_CONNECTING:
+            g_print("Waiting for avahi-daemon\n");
+            break;
+
+        case AVAHI_CLIENT_FAILURE:
+            if (avahi_client_errno(client) == AVAHI_ERR_DISCONNECTED) {
+                /* The daemon went away (e.g. it was restarted). Keep the game
+                 * running and the peers we know about, and reconnect */
+                g_print("Disconnected from avahi-daemon, reconnecting\n");
+                stats.reconnects++;
+                free_client();
+                if (connect_client()) {
+                    break;
+                }
+            } else {
+                g_warning("Avahi client failure: %s",
+                          avahi_strerror(avahi_client_errno(client)));
+            }
+            /* Quit the application */
+            g_main_loop_quit(main_loop);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static bool avahi_start(GMainLoop* loop,
+                        struct discovery_options const* opts,
+                        struct discovery_callbacks const* cbs) {
+    options = *opts;
+    callbacks = cbs;
+    main_loop = loop;
+
+    service_resolvers =
+        g_hash_table_new_full(service_resolver_hash, service_resolver_equal,
+                              (GDestroyNotify)service_resolver_free, NULL);
+    unresolved_clients =
+        g_hash_table_new_full(service_resolver_hash, service_resolver_equal,
+                              (GDestroyNotify)service_resolver_free, NULL);
+
+    glib_poll = avahi_glib_poll_new(NULL, G_PRIORITY_DEFAULT);
+
+    if (!connect_client()) {
+        return false;
+    }
+
+    ops_window.source =
+        g_timeout_add_seconds(OPS_WINDOW_SECONDS, on_ops_window, NULL);
+
+    return true;
+}
+
+static void avahi_stop(void) {
+    for (GList* l = published; l; l = l->next) {
+        stop_service(l->data);
+    }
+    g_clear_pointer(&published, g_list_free);
+
+    if (ops_window.source) {
+        g_source_remove(ops_window.source);
+        ops_window.source = 0;
+    }
+
+    free_client();
+    g_clear_pointer(&service_resolvers, g_hash_table_destroy);
+    g_clear_pointer(&unresolved_clients, g_hash_table_destroy);
+    g_clear_pointer(&glib_poll, avahi_glib_poll_free);
+}
+
+static void avahi_publish(struct local_service* service) {
+    if (g_list_find(published, service) == NULL) {
+        published = g_list_prepend(published, service);
+    }
+
+    if (avahi_client &&
+        avahi_client_get_state(avahi_client) == AVAHI_CLIENT_S_RUNNING) {
+        create_service(avahi_client, service);
+    }
+}
+
+static void avahi_unpublish(struct local_service* service) {
+    published = g_list_remove(published, service);
+    stop_service(service);
+}
+
+static void avahi_update_txt(struct local_service* service) {
+    AvahiEntryGroup* group = service->backend_data;
+
+    if (group == NULL || avahi_entry_group_is_empty(group)) {
+        return;
+    }
+
+    int ret = avahi_entry_group_update_service_txt_strlst(
+        group, service->interface, service->protocol, service->flags,
+        service->name, service->type, service->domain, service->txt_records);
+    if (ret != 0) {
+        g_warning("Failed to update TXT records of '%s': %s\n", service->name,
+                  avahi_strerror(ret));
+    }
+    stats.mdns_ops++;
+}
+
+/* Collects the services in a resolver table that belong to a peer */
+static GArray* peer_services(GHashTable* table, char const* name) {
+    GArray* found =
+        g_array_new(FALSE, FALSE, sizeof(struct service_resolver));
+    GHashTableIter iter;
+    struct service_resolver* sr;
+
+    g_hash_table_iter_init(&iter, table);
+    while (g_hash_table_iter_next(&iter, (gpointer*)&sr, NULL)) {
+        if (g_strcmp0(sr->name, name) == 0) {
+            struct service_resolver key = *sr;
+
+            key.resolver = NULL;
+            key.name = (char*)name;
+            g_array_append_val(found, key);
+        }
+    }
+    return found;
+}
+
+/*
+ * Only the returning peer is looked up again; everyone else keeps their
+ * resolvers. A resolver that has found its service would coalesce a new
+ * resolve and not report it again, so it is replaced by a new one. Clients
+ * that are not resolved are simply reported again.
+ */
+static void avahi_refresh(char const* name) {
+    if (avahi_client == NULL ||
+        avahi_client_get_state(avahi_client) != AVAHI_CLIENT_S_RUNNING) {
+        return;
+    }
+
+    GArray* resolved = peer_services(service_resolvers, name);
+    GArray* unresolved = peer_services(unresolved_clients, name);
+
+    stats.refreshes++;
+    for (guint i = 0; i < resolved->len; i++) {
+        struct service_resolver* key =
+            &g_array_index(resolved, struct service_resolver, i);
+        struct service_resolver* sr =
+            g_hash_table_lookup(service_resolvers, key);
+
+        // One that has not been found yet reports the service by itself
+        if (sr && sr->found) {
+            finish_resolve(sr);
+            request_resolve(key->interface, key->protocol, name, key->type,
+                            key->domain);
+        }
+    }
+    for (guint i = 0; i < unresolved->len; i++) {
+        struct service_resolver* sr =
+            &g_array_index(unresolved, struct service_resolver, i);
+
+        report_unresolved(sr->interface, sr->protocol, name, sr->type,
+                          sr->domain, 0);
+    }
+
+    g_array_unref(unresolved);
+    g_array_unref(resolved);
+}
+
+static void avahi_print_stats(void) {
+    g_print("Resolves: %u started, %u queued, %u coalesced, %u cancelled\n",
+            stats.resolves_started, stats.resolves_queued,
+            stats.resolves_coalesced, stats.resolves_cancelled);
+    g_print("Resolves saved: %u (%u clients not resolved)\n",
+            stats.resolves_coalesced + stats.resolves_cancelled +
+                stats.resolves_skipped,
+            stats.resolves_skipped);
+    g_print("mDNS operations: %u total, %u in the last minute, peak %u/min\n",
+            stats.mdns_ops, ops_window.last, ops_window.peak);
+    g_print("Reconnects to avahi-daemon: %u, peers looked up again: %u\n",
+            stats.reconnects, stats.refreshes);
+}
+
+struct discovery_backend const discovery_avahi = {
+    .name = "avahi",
+    .start = avahi_start,
+    .stop = avahi_stop,
+    .publish = avahi_publish,
+    .unpublish = avahi_unpublish,
+    .update_txt = avahi_update_txt,
+    .refresh = avahi_refresh,
+    .print_stats = avahi_print_stats,
+};
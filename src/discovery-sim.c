@@ -0,0 +1,365 @@
+/*
+ * SPDX-License-Identifier: MIT
+ * Copyright Joshua Watt <JPEWhacker@gmail.com>
+ */
+
+/*
+ * In-process discovery simulator. Instead of talking to avahi-daemon it
+ * generates a deterministic population of client peers from a seed, lets
+ * them arrive in batches and then churns them (leave, rejoin and preference
+ * changes), so the real registry and election code can be driven with
+ * thousands of peers on a single machine.
+ */
+
+#include <arpa/inet.h>
+#include <glib.h>
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include "discovery.h"
+#include "txt.h"
+
+#define SIM_DOMAIN "local"
+#define SIM_INTERFACE (2)
+#define SIM_ARRIVAL_BATCH (32)
+#define SIM_ARRIVAL_INTERVAL_MS (10)
+#define SIM_CHURN_INTERVAL_MS (100)
+// Simulated peers live in 10.0.0.0/8, one address each
+#define SIM_NETWORK (0x0a000000)
+#define SIM_MAX_PEERS (0xfffffe)
+
+struct sim_peer {
+    char name[16];
+    char hostname[24];
+    int host_preference;
+    bool present;
+    AvahiAddress address;
+};
+
+static struct sim_options {
+    int peers;
+    int churn;
+    int seed;
+    int duration;
+    int resync;
+} sim_options = {
+    .peers = 16,
+    .churn = 0,
+    .seed = 1,
+    .duration = 60,
+};
+
+static struct sim {
+    GMainLoop* loop;
+    struct discovery_callbacks const* callbacks;
+    uint16_t port;
+    GRand* rand;
+    struct sim_peer* peers;
+    int arrived;
+    int churn_credit;
+    guint arrival_source;
+    guint churn_source;
+    guint finish_source;
+    guint resync_source;
+    // Local services, echoed again on a re-sync
+    GList* published;
+    gint64 started_at;
+} sim;
+
+static struct stats {
+    unsigned resolved;
+    unsigned removed;
+    unsigned txt_changes;
+    unsigned resyncs;
+    unsigned refreshes;
+} stats;
+
+static void sim_deliver(struct sim_peer* peer) {
+    AvahiStringList* txt = NULL;
+
+    txt = avahi_string_list_add_printf(txt, "%s=%d", TXT_VERSION_KEY,
+                                       TXT_VERSION);
+    txt = avahi_string_list_add_printf(txt, "%s=%d", HOST_PREF_KEY,
+                                       peer->host_preference);
+
+    struct discovery_record record = {
+        .interface = SIM_INTERFACE,
+        .protocol = AVAHI_PROTO_INET,
+        .name = peer->name,
+        .type = CLIENT_SERVICE_NAME,
+        .domain = SIM_DOMAIN,
+        .hostname = peer->hostname,
+        .address = &peer->address,
+        .port = sim.port,
+        .txt = txt,
+        .flags = AVAHI_LOOKUP_RESULT_MULTICAST,
+    };
+
+    peer->present = true;
+    stats.resolved++;
+    sim.callbacks->resolved(&record);
+    avahi_string_list_free(txt);
+}
+
+static void sim_remove(struct sim_peer* peer) {
+    peer->present = false;
+    stats.removed++;
+    sim.callbacks->removed(SIM_INTERFACE, AVAHI_PROTO_INET, peer->name,
+                           CLIENT_SERVICE_NAME, SIM_DOMAIN);
+}
+
+static gboolean on_sim_arrival(gpointer userdata) {
+    int end = MIN(sim.arrived + SIM_ARRIVAL_BATCH, sim_options.peers);
+
+    for (; sim.arrived < end; sim.arrived++) {
+        sim_deliver(&sim.peers[sim.arrived]);
+    }
+
+    if (sim.arrived < sim_options.peers) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    g_print("Simulator: all %d peers arrived after %" G_GINT64_FORMAT " ms\n",
+            sim_options.peers,
+            (g_get_monotonic_time() - sim.started_at) / 1000);
+    sim.arrival_source = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/* Applies one random churn event to an already arrived peer */
+static void sim_churn_one(void) {
+    struct sim_peer* peer =
+        &sim.peers[g_rand_int_range(sim.rand, 0, sim.arrived)];
+
+    if (!peer->present) {
+        sim_deliver(peer);
+    } else if (g_rand_boolean(sim.rand)) {
+        sim_remove(peer);
+    } else {
+        peer->host_preference =
+            (peer->host_preference + g_rand_int_range(sim.rand, 1, 3)) % 3;
+        stats.txt_changes++;
+        sim_deliver(peer);
+    }
+}
+
+static gboolean on_sim_churn(gpointer userdata) {
+    if (sim.arrived == 0) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    // churn is in events per second; carry the remainder between ticks
+    sim.churn_credit += sim_options.churn * SIM_CHURN_INTERVAL_MS;
+    while (sim.churn_credit >= 1000) {
+        sim.churn_credit -= 1000;
+        sim_churn_one();
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_sim_finished(gpointer userdata) {
+    g_print("Simulator: finished after %d seconds\n", sim_options.duration);
+    sim.finish_source = 0;
+    g_main_loop_quit(sim.loop);
+    return G_SOURCE_REMOVE;
+}
+
+static void sim_echo(struct local_service* service);
+
+/*
+ * Reports every present peer and local service again inside a re-sync, the
+ * way reconnecting to avahi-daemon does. Nothing may go away in between.
+ */
+static void sim_resync(void) {
+    stats.resyncs++;
+    sim.callbacks->resync_begin();
+    for (int i = 0; i < sim.arrived; i++) {
+        if (sim.peers[i].present) {
+            sim_deliver(&sim.peers[i]);
+        }
+    }
+    for (GList* l = sim.published; l; l = l->next) {
+        sim_echo(l->data);
+    }
+    sim.callbacks->resync_end();
+}
+
+static gboolean on_sim_resync(gpointer userdata) {
+    sim_resync();
+    return G_SOURCE_CONTINUE;
+}
+
+static void sim_refresh(char const* name) {
+    unsigned index;
+
+    stats.refreshes++;
+    if (sscanf(name, "sim-%x", &index) == 1 && index < (unsigned)sim.arrived &&
+        sim.peers[index].present) {
+        sim_deliver(&sim.peers[index]);
+    }
+}
+
+static GOptionGroup* sim_option_group(void) {
+    static const GOptionEntry entries[] = {
+        {"sim-peers", 0, 0, G_OPTION_ARG_INT, &sim_options.peers,
+         "Number of simulated peers", "N"},
+        {"sim-churn", 0, 0, G_OPTION_ARG_INT, &sim_options.churn,
+         "Simulated churn events per second", "N"},
+        {"sim-seed", 0, 0, G_OPTION_ARG_INT, &sim_options.seed,
+         "Simulator random seed", "SEED"},
+        {"sim-duration", 0, 0, G_OPTION_ARG_INT, &sim_options.duration,
+         "Seconds to run the simulation for (0 runs until interrupted)",
+         "SECONDS"},
+        {"sim-resync", 0, 0, G_OPTION_ARG_INT, &sim_options.resync,
+         "Seconds between simulated re-syncs (0 disables them)", "SECONDS"},
+        {},
+    };
+
+    GOptionGroup* group =
+        g_option_group_new("sim", "Discovery simulator options",
+                           "Show discovery simulator options", NULL, NULL);
+    g_option_group_add_entries(group, entries);
+    return group;
+}
+
+static bool sim_start(GMainLoop* loop, struct discovery_options const* opts,
+                      struct discovery_callbacks const* cbs) {
+    if (sim_options.peers < 0 || sim_options.peers > SIM_MAX_PEERS) {
+        g_warning("Simulator peer count must be between 0 and %d",
+                  SIM_MAX_PEERS);
+        return false;
+    }
+
+    sim.loop = loop;
+    sim.callbacks = cbs;
+    sim.rand = g_rand_new_with_seed(sim_options.seed);
+    sim.peers = g_new0(struct sim_peer, MAX(sim_options.peers, 1));
+    sim.started_at = g_get_monotonic_time();
+
+    for (int i = 0; i < sim_options.peers; i++) {
+        struct sim_peer* peer = &sim.peers[i];
+
+        snprintf(peer->name, sizeof(peer->name), "sim-%06x", i);
+        snprintf(peer->hostname, sizeof(peer->hostname), "%s.local",
+                 peer->name);
+        peer->host_preference = g_rand_int_range(sim.rand, 0, 3);
+        peer->address.proto = AVAHI_PROTO_INET;
+        peer->address.data.ipv4.address = htonl(SIM_NETWORK | (i + 1));
+    }
+
+    g_print("Simulator: %d peers, %d churn events/s, seed %d\n",
+            sim_options.peers, sim_options.churn, sim_options.seed);
+
+    sim.arrival_source =
+        g_timeout_add(SIM_ARRIVAL_INTERVAL_MS, on_sim_arrival, NULL);
+    if (sim_options.churn > 0) {
+        sim.churn_source =
+            g_timeout_add(SIM_CHURN_INTERVAL_MS, on_sim_churn, NULL);
+    }
+    if (sim_options.duration > 0) {
+        sim.finish_source =
+            g_timeout_add_seconds(sim_options.duration, on_sim_finished, NULL);
+    }
+    if (sim_options.resync > 0) {
+        sim.resync_source =
+            g_timeout_add_seconds(sim_options.resync, on_sim_resync, NULL);
+    }
+
+    return true;
+}
+
+static void sim_clear_source(guint* source) {
+    if (*source) {
+        g_source_remove(*source);
+        *source = 0;
+    }
+}
+
+static void sim_stop(void) {
+    sim_clear_source(&sim.arrival_source);
+    sim_clear_source(&sim.churn_source);
+    sim_clear_source(&sim.finish_source);
+    sim_clear_source(&sim.resync_source);
+    g_clear_pointer(&sim.published, g_list_free);
+    g_clear_pointer(&sim.peers, g_free);
+    g_clear_pointer(&sim.rand, g_rand_free);
+}
+
+/*
+ * Local services are echoed straight back as our own, the way avahi-daemon
+ * reports services published by this host.
+ */
+static void sim_echo(struct local_service* service) {
+    AvahiAddress address = {.proto = AVAHI_PROTO_INET};
+
+    address.data.ipv4.address = htonl(INADDR_LOOPBACK);
+
+    struct discovery_record record = {
+        .interface = SIM_INTERFACE,
+        .protocol = AVAHI_PROTO_INET,
+        .name = service->name,
+        .type = service->type,
+        .domain = SIM_DOMAIN,
+        .hostname = "localhost.local",
+        .address = &address,
+        .port = service->port,
+        .txt = service->txt_records,
+        .flags = AVAHI_LOOKUP_RESULT_LOCAL | AVAHI_LOOKUP_RESULT_OUR_OWN,
+    };
+    sim.callbacks->resolved(&record);
+}
+
+static void sim_publish(struct local_service* service) {
+    if (service->backend_data) {
+        return;
+    }
+    service->backend_data = GINT_TO_POINTER(1);
+    sim.published = g_list_prepend(sim.published, service);
+    sim.port = service->port;
+    sim_echo(service);
+}
+
+static void sim_update_txt(struct local_service* service) {
+    if (service->backend_data) {
+        sim_echo(service);
+    }
+}
+
+static void sim_unpublish(struct local_service* service) {
+    if (service->backend_data) {
+        service->backend_data = NULL;
+        sim.published = g_list_remove(sim.published, service);
+        sim.callbacks->removed(SIM_INTERFACE, AVAHI_PROTO_INET, service->name,
+                               service->type, SIM_DOMAIN);
+    }
+}
+
+static void sim_print_stats(void) {
+    struct rusage usage;
+
+    g_print("Simulator events: %u resolved, %u removed, %u TXT changes, %u "
+            "re-syncs, %u refreshes\n",
+            stats.resolved, stats.removed, stats.txt_changes, stats.resyncs,
+            stats.refreshes);
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        g_print("Simulator CPU time: %ld.%03ld s user, %ld.%03ld s system\n",
+                (long)usage.ru_utime.tv_sec,
+                (long)usage.ru_utime.tv_usec / 1000,
+                (long)usage.ru_stime.tv_sec,
+                (long)usage.ru_stime.tv_usec / 1000);
+    }
+}
+
+struct discovery_backend const discovery_sim = {
+    .name = "sim",
+    .option_group = sim_option_group,
+    .start = sim_start,
+    .stop = sim_stop,
+    .publish = sim_publish,
+    .unpublish = sim_unpublish,
+    .update_txt = sim_update_txt,
+    .refresh = sim_refresh,
+    .print_stats = sim_print_stats,
+};
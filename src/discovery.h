@@ -0,0 +1,121 @@
+/*
+ * SPDX-License-Identifier: MIT
+ * Copyright Joshua Watt <JPEWhacker@gmail.com>
+ */
+
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <avahi-common/address.h>
+#include <avahi-common/defs.h>
+#include <avahi-common/strlst.h>
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CLIENT_SERVICE_NAME "_oe-doom-client._udp"
+#define HOST_SERVICE_NAME "_oe-doom-host._udp"
+// Subtype of the client service advertised by daemons that can host
+#define HOST_ELIGIBLE_SUBTYPE "_can-host._sub." CLIENT_SERVICE_NAME
+
+/*
+ * A service published by this daemon. The backend owns backend_data and may
+ * rename the service if its name collides with another one on the network.
+ */
+struct local_service {
+    void* backend_data;
+    char* service_name;
+    AvahiIfIndex interface;
+    AvahiProtocol protocol;
+    AvahiPublishFlags flags;
+    char* name;
+    char* type;
+    char* domain;
+    char* host;
+    // Optional DNS-SD subtype to register the service under as well
+    char const* subtype;
+    uint16_t port;
+    AvahiStringList* txt_records;
+};
+
+/*
+ * A resolved service instance as reported by a backend. The strings, address
+ * and TXT records are only valid for the duration of the callback. A client
+ * that was browsed but deliberately not resolved is reported with an empty
+ * hostname and no address or TXT records.
+ */
+struct discovery_record {
+    AvahiIfIndex interface;
+    AvahiProtocol protocol;
+    char const* name;
+    char const* type;
+    char const* domain;
+    char const* hostname;
+    // NULL if the backend did not resolve an address
+    AvahiAddress const* address;
+    uint16_t port;
+    AvahiStringList* txt;
+    AvahiLookupResultFlags flags;
+};
+
+/*
+ * Events delivered by a backend. resolved() is called for new instances and
+ * again whenever an instance's records change; removed() when an instance
+ * goes away.
+ */
+struct discovery_callbacks {
+    void (*resolved)(struct discovery_record const* record);
+    void (*removed)(AvahiIfIndex interface, AvahiProtocol protocol,
+                    char const* name, char const* type, char const* domain);
+    // Services on interfaces this returns false for are ignored
+    bool (*interface_allowed)(AvahiIfIndex interface);
+    /*
+     * Bracket a re-sync after the backend lost track of the network, e.g.
+     * when avahi-daemon restarted. Every current service is reported again
+     * in between; those that are not have gone away.
+     */
+    void (*resync_begin)(void);
+    void (*resync_end)(void);
+};
+
+struct discovery_options {
+    AvahiProtocol protocol;
+    int max_resolvers;
+    /*
+     * Keep mDNS traffic down on large networks: only clients advertising
+     * HOST_ELIGIBLE_SUBTYPE are resolved, and only if this daemon can host
+     * itself (otherwise no client can change what it does). Client addresses
+     * are never looked up.
+     */
+    bool low_chatter;
+    bool can_host;
+};
+
+/*
+ * A discovery backend browses for the client and host service types and
+ * publishes local services. Backends run on the GLib main loop; they quit
+ * the loop if discovery fails permanently.
+ */
+struct discovery_backend {
+    char const* name;
+    // Backend specific command line options, may be NULL
+    GOptionGroup* (*option_group)(void);
+    bool (*start)(GMainLoop* loop, struct discovery_options const* options,
+                  struct discovery_callbacks const* callbacks);
+    void (*stop)(void);
+    void (*publish)(struct local_service* service);
+    void (*unpublish)(struct local_service* service);
+    // Re-announces a published service after its txt_records changed
+    void (*update_txt)(struct local_service* service);
+    /*
+     * Reports every current instance of a peer's services again, for when
+     * the daemon dropped a peer that the backend may still have cached
+     */
+    void (*refresh)(char const* name);
+    void (*print_stats)(void);
+};
+
+extern struct discovery_backend const discovery_avahi;
+extern struct discovery_backend const discovery_sim;
+
+#endif
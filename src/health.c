@@ -0,0 +1,162 @@
+/*
+ * SPDX-License-Identifier: MIT
+ * Copyright Joshua Watt <JPEWhacker@gmail.com>
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "health.h"
+
+#define SYSFS_THERMAL "/sys/class/thermal"
+#define SYSFS_CPUFREQ "/sys/devices/system/cpu/cpufreq"
+#define PROC_PRESSURE_CPU "/proc/pressure/cpu"
+
+// Stressed above the first threshold, recovered below the second
+#define HOT_TEMPERATURE (80000)
+#define COOL_TEMPERATURE (75000)
+#define HIGH_CPU_PRESSURE (40)
+#define LOW_CPU_PRESSURE (20)
+
+static struct health_state {
+    bool stressed;
+    // Frequency limit at the first sample; a lower one means throttling
+    int baseline_freq_limit;
+    struct health last;
+    unsigned samples;
+    unsigned stressed_samples;
+    unsigned transitions;
+} state;
+
+static bool read_int(char const* path, long* value) {
+    g_autofree char* contents = NULL;
+    char* end;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return false;
+    }
+
+    *value = strtol(contents, &end, 10);
+    return end != contents;
+}
+
+static int hottest_zone(void) {
+    g_autoptr(GDir) dir = g_dir_open(SYSFS_THERMAL, 0, NULL);
+    char const* name;
+    long hottest = 0;
+
+    if (dir == NULL) {
+        return 0;
+    }
+
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        if (!g_str_has_prefix(name, "thermal_zone")) {
+            continue;
+        }
+
+        g_autofree char* path =
+            g_build_filename(SYSFS_THERMAL, name, "temp", NULL);
+        long temp;
+        if (read_int(path, &temp)) {
+            hottest = MAX(hottest, temp);
+        }
+    }
+
+    return hottest;
+}
+
+/* The lowest scaling_max_freq of any policy relative to what it can do */
+static int lowest_freq_limit(void) {
+    g_autoptr(GDir) dir = g_dir_open(SYSFS_CPUFREQ, 0, NULL);
+    char const* name;
+    int lowest = 0;
+
+    if (dir == NULL) {
+        return 0;
+    }
+
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        if (!g_str_has_prefix(name, "policy")) {
+            continue;
+        }
+
+        g_autofree char* limit_path =
+            g_build_filename(SYSFS_CPUFREQ, name, "scaling_max_freq", NULL);
+        g_autofree char* max_path =
+            g_build_filename(SYSFS_CPUFREQ, name, "cpuinfo_max_freq", NULL);
+        long limit, max;
+        if (read_int(limit_path, &limit) && read_int(max_path, &max) &&
+            max > 0) {
+            int percent = MIN(limit * 100 / max, 100);
+            lowest = lowest ? MIN(lowest, percent) : percent;
+        }
+    }
+
+    return lowest;
+}
+
+static int cpu_pressure(void) {
+    g_autofree char* contents = NULL;
+    double avg10;
+
+    if (!g_file_get_contents(PROC_PRESSURE_CPU, &contents, NULL, NULL) ||
+        sscanf(contents, "some avg10=%lf", &avg10) != 1) {
+        return 0;
+    }
+    return avg10;
+}
+
+void health_sample(struct health* health) {
+    health->temperature = hottest_zone();
+    health->freq_limit = lowest_freq_limit();
+    health->cpu_pressure = cpu_pressure();
+}
+
+bool health_check(void) {
+    struct health* h = &state.last;
+    bool stressed;
+
+    health_sample(h);
+    if (!state.samples++) {
+        state.baseline_freq_limit = h->freq_limit;
+    }
+
+    bool throttled = h->freq_limit < state.baseline_freq_limit;
+    if (state.stressed) {
+        stressed = h->temperature >= COOL_TEMPERATURE ||
+                   h->cpu_pressure >= LOW_CPU_PRESSURE || throttled;
+    } else {
+        stressed = h->temperature >= HOT_TEMPERATURE ||
+                   h->cpu_pressure >= HIGH_CPU_PRESSURE || throttled;
+    }
+
+    if (stressed != state.stressed) {
+        g_print("Board is %s (%d.%d C, frequency limit %d%%, CPU pressure "
+                "%d%%)\n",
+                stressed ? "stressed" : "no longer stressed",
+                h->temperature / 1000, h->temperature % 1000 / 100,
+                h->freq_limit, h->cpu_pressure);
+        state.stressed = stressed;
+        state.transitions++;
+    }
+
+    if (stressed) {
+        state.stressed_samples++;
+    }
+    return stressed;
+}
+
+void health_print_stats(void) {
+    if (!state.samples) {
+        return;
+    }
+
+    g_print("Health: stressed in %u of %u samples, %u transitions (last %d.%d "
+            "C, frequency limit %d%%, CPU pressure %d%%)\n",
+            state.stressed_samples, state.samples, state.transitions,
+            state.last.temperature / 1000,
+            state.last.temperature % 1000 / 100, state.last.freq_limit,
+            state.last.cpu_pressure);
+}
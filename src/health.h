@@ -0,0 +1,37 @@
+/*
+ * SPDX-License-Identifier: MIT
+ * Copyright Joshua Watt <JPEWhacker@gmail.com>
+ */
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdbool.h>
+
+/*
+ * Thermal and load state of this board, from the thermal zones, the cpufreq
+ * limits and the kernel's pressure stall information. Values that cannot be
+ * read (e.g. in a container) are reported as 0 and never count as stressed.
+ */
+struct health {
+    // Hottest thermal zone in millidegrees Celsius
+    int temperature;
+    // Lowest frequency limit of any CPU as a percentage of its maximum; a
+    // limit below the one seen at the first check counts as throttling
+    int freq_limit;
+    // Share of the last 10 s some task was stalled on the CPU, in percent
+    int cpu_pressure;
+};
+
+void health_sample(struct health* health);
+
+/*
+ * Samples the board and returns whether it is too hot, throttled or loaded
+ * to host well. Entering and leaving that state use separate thresholds, so
+ * a board hovering around one does not flip back and forth.
+ */
+bool health_check(void);
+
+void health_print_stats(void);
+
+#endif
@@ -0,0 +1,269 @@
+/*
+ * SPDX-License-Identifier: MIT
+ * Copyright Joshua Watt <JPEWhacker@gmail.com>
+ */
+
+#include <arpa/inet.h>
+#include <glib.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "interfaces.h"
+
+#define SYSFS_NET "/sys/class/net"
+
+static struct interface_config {
+    char** allow;
+    char** deny;
+    char** priority;
+} interface_config;
+
+// Interfaces by index, owning their struct net_interface
+static GHashTable* interfaces = NULL;
+
+static bool name_matches(char** patterns, char const* name) {
+    for (int i = 0; patterns && patterns[i]; i++) {
+        if (g_pattern_match_simple(patterns[i], name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool name_allowed(char const* name) {
+    if (interface_config.allow && interface_config.allow[0] &&
+        !name_matches(interface_config.allow, name)) {
+        return false;
+    }
+    return !name_matches(interface_config.deny, name);
+}
+
+static char* read_sysfs(char const* name, char const* attribute) {
+    g_autofree char* path =
+        g_build_filename(SYSFS_NET, name, attribute, NULL);
+    char* contents = NULL;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return NULL;
+    }
+    return g_strstrip(contents);
+}
+
+static bool sysfs_is_wireless(char const* name) {
+    g_autofree char* wireless =
+        g_build_filename(SYSFS_NET, name, "wireless", NULL);
+    g_autofree char* phy = g_build_filename(SYSFS_NET, name, "phy80211", NULL);
+
+    return g_file_test(wireless, G_FILE_TEST_EXISTS) ||
+           g_file_test(phy, G_FILE_TEST_EXISTS);
+}
+
+static void net_interface_free(struct net_interface* iface) {
+    if (iface) {
+        g_hash_table_destroy(iface->peers);
+        g_free(iface);
+    }
+}
+
+/* Looks up an interface, reading its link properties on first use */
+static struct net_interface* interface_get(AvahiIfIndex index) {
+    struct net_interface* iface;
+
+    if (index <= 0) {
+        return NULL;
+    }
+
+    iface = g_hash_table_lookup(interfaces, GINT_TO_POINTER(index));
+    if (iface) {
+        return iface;
+    }
+
+    iface = g_new0(struct net_interface, 1);
+    iface->index = index;
+    iface->priority = G_MAXINT;
+    iface->peers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    if (if_indextoname(index, iface->name) == NULL) {
+        snprintf(iface->name, sizeof(iface->name), "if%d", index);
+        iface->allowed = true;
+    } else {
+        g_autofree char* speed = read_sysfs(iface->name, "speed");
+
+        iface->allowed = name_allowed(iface->name);
+        iface->wireless = sysfs_is_wireless(iface->name);
+        // Reads as -1 or fails when the driver does not know
+        iface->speed = speed ? MAX(atoi(speed), 0) : 0;
+
+        for (int i = 0; interface_config.priority &&
+                        interface_config.priority[i];
+             i++) {
+            if (g_pattern_match_simple(interface_config.priority[i],
+                                       iface->name)) {
+                iface->priority = i;
+                break;
+            }
+        }
+    }
+
+    g_print("Interface %s (%d): %s, %s, %d Mb/s\n", iface->name, index,
+            iface->allowed ? "allowed" : "ignored",
+            iface->wireless ? "wireless" : "wired", iface->speed);
+
+    g_hash_table_insert(interfaces, GINT_TO_POINTER(index), iface);
+    return iface;
+}
+
+void interfaces_init(char** allow, char** deny, char** priority) {
+    interface_config.allow = allow;
+    interface_config.deny = deny;
+    interface_config.priority = priority;
+
+    interfaces = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                       (GDestroyNotify)net_interface_free);
+}
+
+void interfaces_cleanup(void) {
+    g_clear_pointer(&interfaces, g_hash_table_destroy);
+}
+
+bool interface_allowed(AvahiIfIndex index) {
+    struct net_interface* iface = interface_get(index);
+    return iface == NULL || iface->allowed;
+}
+
+bool interface_is_wireless(AvahiIfIndex index) {
+    struct net_interface* iface = interface_get(index);
+    return iface && iface->wireless;
+}
+
+int interface_cmp(AvahiIfIndex a, AvahiIfIndex b) {
+    struct net_interface* ia = interface_get(a);
+    struct net_interface* ib = interface_get(b);
+
+    if (ia == ib || ia == NULL || ib == NULL) {
+        return 0;
+    }
+
+    if (ia->priority != ib->priority) {
+        return ia->priority < ib->priority ? -1 : 1;
+    }
+
+    if (ia->wireless != ib->wireless) {
+        return ia->wireless ? 1 : -1;
+    }
+
+    return ib->speed - ia->speed;
+}
+
+bool interfaces_local_wireless(void) {
+    g_autoptr(GDir) dir = g_dir_open(SYSFS_NET, 0, NULL);
+    char const* name;
+    bool any_wireless = false;
+
+    if (dir == NULL) {
+        return false;
+    }
+
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        g_autofree char* operstate = read_sysfs(name, "operstate");
+
+        if (g_strcmp0(name, "lo") == 0 || !name_allowed(name) ||
+            g_strcmp0(operstate, "up") != 0) {
+            continue;
+        }
+
+        if (!sysfs_is_wireless(name)) {
+            return false;
+        }
+        any_wireless = true;
+    }
+
+    return any_wireless;
+}
+
+bool interfaces_local_network(char* buf, size_t size) {
+    struct ifaddrs* addrs;
+    struct ifaddrs* best = NULL;
+    AvahiIfIndex best_index = 0;
+
+    if (getifaddrs(&addrs) < 0) {
+        return false;
+    }
+
+    for (struct ifaddrs* ifa = addrs; ifa; ifa = ifa->ifa_next) {
+        AvahiIfIndex index;
+
+        if (ifa->ifa_addr == NULL || ifa->ifa_netmask == NULL ||
+            ifa->ifa_addr->sa_family != AF_INET ||
+            !(ifa->ifa_flags & IFF_UP) || (ifa->ifa_flags & IFF_LOOPBACK) ||
+            !name_allowed(ifa->ifa_name)) {
+            continue;
+        }
+
+        index = if_nametoindex(ifa->ifa_name);
+        if (best == NULL || interface_cmp(index, best_index) < 0) {
+            best = ifa;
+            best_index = index;
+        }
+    }
+
+    if (best) {
+        struct in_addr address =
+            ((struct sockaddr_in*)best->ifa_addr)->sin_addr;
+        uint32_t mask =
+            ntohl(((struct sockaddr_in*)best->ifa_netmask)->sin_addr.s_addr);
+        char network[INET_ADDRSTRLEN];
+
+        address.s_addr &= htonl(mask);
+        inet_ntop(AF_INET, &address, network, sizeof(network));
+        snprintf(buf, size, "%s/%d", network, __builtin_popcount(mask));
+    }
+
+    freeifaddrs(addrs);
+    return best != NULL;
+}
+
+void interface_peer_add(AvahiIfIndex index, char const* name) {
+    struct net_interface* iface = interface_get(index);
+    gpointer count;
+
+    if (iface == NULL) {
+        return;
+    }
+
+    count = g_hash_table_lookup(iface->peers, name);
+    g_hash_table_insert(iface->peers, g_strdup(name),
+                        GINT_TO_POINTER(GPOINTER_TO_INT(count) + 1));
+}
+
+void interface_peer_remove(AvahiIfIndex index, char const* name) {
+    struct net_interface* iface = interface_get(index);
+    int count;
+
+    if (iface == NULL) {
+        return;
+    }
+
+    count = GPOINTER_TO_INT(g_hash_table_lookup(iface->peers, name));
+    if (count > 1) {
+        g_hash_table_insert(iface->peers, g_strdup(name),
+                            GINT_TO_POINTER(count - 1));
+    } else {
+        g_hash_table_remove(iface->peers, name);
+    }
+}
+
+void interfaces_print_stats(void) {
+    GHashTableIter iter;
+    struct net_interface* iface;
+
+    g_hash_table_iter_init(&iter, interfaces);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&iface)) {
+        g_print("Interface %s: %u peers (%s, %s, %d Mb/s)\n", iface->name,
+                g_hash_table_size(iface->peers),
+                iface->allowed ? "allowed" : "ignored",
+                iface->wireless ? "wireless" : "wired", iface->speed);
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * SPDX-License-Identifier: MIT
+ * Copyright Joshua Watt <JPEWhacker@gmail.com>
+ */
+
+#ifndef INTERFACES_H
+#define INTERFACES_H
+
+#include <avahi-common/defs.h>
+#include <glib.h>
+#include <net/if.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A network interface services were discovered on, with the link properties
+ * read from sysfs when it was first seen and the table of peers reachable
+ * over it.
+ */
+struct net_interface {
+    AvahiIfIndex index;
+    char name[IF_NAMESIZE];
+    bool allowed;
+    bool wireless;
+    // Link speed in Mb/s, 0 if unknown
+    int speed;
+    // Position in the configured priority list, G_MAXINT if not listed
+    int priority;
+    // Peer name -> number of service instances seen over this interface
+    GHashTable* peers;
+};
+
+/*
+ * Sets up interface filtering. Each list may be NULL; entries are interface
+ * names or glob patterns such as "wl*".
+ */
+void interfaces_init(char** allow, char** deny, char** priority);
+void interfaces_cleanup(void);
+
+bool interface_allowed(AvahiIfIndex index);
+
+/*
+ * Orders interfaces for game traffic: configured priority first, then wired
+ * before wireless, then faster links. Returns < 0 if a is preferred.
+ */
+int interface_cmp(AvahiIfIndex a, AvahiIfIndex b);
+
+bool interface_is_wireless(AvahiIfIndex index);
+
+/* True if every usable local link is wireless */
+bool interfaces_local_wireless(void);
+
+/*
+ * Formats the IPv4 network ("address/prefix") of the usable local interface
+ * most preferred for game traffic, as a hint of where this device sits on
+ * the network. Returns false if there is none.
+ */
+bool interfaces_local_network(char* buf, size_t size);
+
+void interface_peer_add(AvahiIfIndex index, char const* name);
+void interface_peer_remove(AvahiIfIndex index, char const* name);
+
+void interfaces_print_stats(void);
+
+#endif
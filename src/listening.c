@@ -0,0 +1,88 @@
+/*
+ * SPDX-License-Identifier: MIT
+ * Copyright Joshua Watt <JPEWhacker@gmail.com>
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "listening.h"
+
+// A process rarely has more than one socket per protocol on the same port
+#define MAX_SOCKETS (8)
+
+struct sockets {
+    unsigned long inodes[MAX_SOCKETS];
+    int count;
+};
+
+/* Collects the inodes of the sockets bound to the port in a /proc/net table */
+static void find_bound(char const* path, uint16_t port,
+                       struct sockets* sockets) {
+    g_autofree char* contents = NULL;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return;
+    }
+
+    // The first line is the header
+    char* line = strchr(contents, '\n');
+    while (line && sockets->count < MAX_SOCKETS) {
+        unsigned local_port;
+        unsigned long inode;
+
+        line++;
+        if (sscanf(line,
+                   "%*d: %*[0-9A-Fa-f]:%x %*[0-9A-Fa-f]:%*x %*x %*x:%*x "
+                   "%*x:%*x %*x %*u %*u %lu",
+                   &local_port, &inode) == 2 &&
+            local_port == port && inode != 0) {
+            sockets->inodes[sockets->count++] = inode;
+        }
+        line = strchr(line, '\n');
+    }
+}
+
+static bool owns_socket(pid_t pid, struct sockets const* sockets) {
+    g_autofree char* fd_path = g_strdup_printf("/proc/%d/fd", (int)pid);
+    g_autoptr(GDir) dir = g_dir_open(fd_path, 0, NULL);
+    char const* name;
+
+    if (dir == NULL) {
+        return false;
+    }
+
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        g_autofree char* path = g_build_filename(fd_path, name, NULL);
+        char target[64];
+        ssize_t len = readlink(path, target, sizeof(target) - 1);
+        unsigned long inode;
+
+        if (len < 0) {
+            continue;
+        }
+        target[len] = '\0';
+
+        if (sscanf(target, "socket:[%lu]", &inode) != 1) {
+            continue;
+        }
+        for (int i = 0; i < sockets->count; i++) {
+            if (sockets->inodes[i] == inode) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+bool listening_udp(pid_t pid, uint16_t port) {
+    struct sockets sockets = {};
+
+    find_bound("/proc/net/udp", port, &sockets);
+    find_bound("/proc/net/udp6", port, &sockets);
+
+    return sockets.count && owns_socket(pid, &sockets);
+}
@@ -0,0 +1,19 @@
+/*
+ * SPDX-License-Identifier: MIT
+ * Copyright Joshua Watt <JPEWhacker@gmail.com>
+ */
+
+#ifndef LISTENING_H
+#define LISTENING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Returns whether the process has a UDP socket bound to the port, from
+ * /proc/net/udp, /proc/net/udp6 and the socket inodes of its open files.
+ */
+bool listening_udp(pid_t pid, uint16_t port);
+
+#endif
@@ -3,39 +3,126 @@
  * Copyright Joshua Watt <JPEWhacker@gmail.com>
  */
 
-#include <avahi-client/client.h>
-#include <avahi-client/lookup.h>
-#include <avahi-client/publish.h>
-#include <avahi-common/alternative.h>
-#include <avahi-common/error.h>
+#include <arpa/inet.h>
+#include <avahi-common/domain.h>
+#include <avahi-common/malloc.h>
 #include <avahi-glib/glib-malloc.h>
-#include <avahi-glib/glib-watch.h>
+#include <errno.h>
 #include <glib-unix.h>
 #include <glib.h>
 #include <libudev.h>
+#include <netinet/in.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/queue.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 #include <systemd/sd-id128.h>
+#include <unistd.h>
 
-#define CLIENT_SERVICE_NAME "_oe-doom-client._udp"
-#define HOST_SERVICE_NAME "_oe-doom-host._udp"
-
-#define WAD_KEY "wad"
-#define HOST_PREF_KEY "pref"
+#include "capability.h"
+#include "discovery.h"
+#include "health.h"
+#include "interfaces.h"
+#include "listening.h"
+#include "txt.h"
 
 #define DEFAULT_CONFIG_PATH "/etc/oe-zdoom/config.ini"
+#define DEFAULT_CACHE_DIR "/var/cache/oe-doom-launcher"
+#define PEER_CACHE_FILE "peers"
+#define PEER_CACHE_VERSION (1)
+#define PEER_CACHE_MAX_LINE (256)
 #define DEFAULT_ZDOOM "zdoom"
 #define DEFAULT_MP_WAD "freedm.wad"
 #define DEFAULT_MP_MAP "MAP01"
 #define DEFAULT_SP_WAD "freedoom1.wad"
 #define DEFAULT_SOURCE_WAIT (30)
+// Quiet window used while peers arrive slowly, before it adapts to churn
+#define DEFAULT_SOURCE_MIN_WAIT (3)
+// Longest the election waits for the network to settle down
+#define DEFAULT_SOURCE_MAX_WAIT (60)
+// Source wait used when every peer from the previous session is back
+#define WARM_START_WAIT (2)
+#define DEFAULT_MAX_RESOLVERS (8)
+// Preference lead a challenger needs to take over from a running host
+#define DEFAULT_HOST_SWITCH_MARGIN (1)
+// zdoom supports at most 8 players in a game
+#define MAX_PLAYERS (8)
+// Batches membership digest changes before re-announcing our TXT records
+#define DIGEST_PUBLISH_DELAY_MS (250)
+#define HEALTH_CHECK_INTERVAL (5)
+// Advertised stress changes from the health check are at least this many
+// seconds apart, so a board on the edge does not flood mDNS or keep moving
+// the game
+#define HEALTH_STRESS_HOLD (30)
+// The host service is advertised once zdoom listens on the game port, which
+// is checked this often. If that cannot be seen in time (e.g. zdoom is run
+// from a wrapper that forks), it is advertised anyway.
+#define HOST_READY_POLL_MS (50)
+#define HOST_READY_TIMEOUT (15 * G_USEC_PER_SEC)
+// How long clients wait for the successor of a departed host to take over.
+// The successor only advertises once its zdoom listens, so this allows for
+// the whole HOST_READY_TIMEOUT.
+#define SUCCESSOR_TIMEOUT_MS (HOST_READY_TIMEOUT / 1000 + 3000)
+
+// Path probes are small UDP echo requests answered by the other daemons
+#define PROBE_MAGIC (0x4f454450)  // "OEDP"
+#define PROBE_ECHO_REQUEST (1)
+#define PROBE_ECHO_REPLY (2)
+#define PROBE_RTT_REQUEST (3)
+#define PROBE_RTT_REPLY (4)
+#define PROBE_HEARTBEAT (5)
+#define PROBE_TIMEOUT_MS (250)
+#define MAX_PROBE_PATHS (8)
+// Daemons that can host probe the round trip time to every peer this often
+#define RTT_PROBE_INTERVAL_MS (5000)
+#define RTT_MAX_PROBES (256)
+// Samples older than this many rounds no longer count
+#define RTT_MAX_AGE_ROUNDS (3)
+// Advertised RTTs are rounded up to this, so jitter does not reorder hosts
+#define RTT_BUCKET_MS (5)
+// The advertised RTT only moves once it is off by more than a bucket, so it
+// does not flap between two neighbouring buckets
+#define RTT_HYSTERESIS_MS (RTT_BUCKET_MS)
+// Every daemon sends each peer a heartbeat this often, and declares a peer
+// that has been silent for HEARTBEAT_TIMEOUT_MS gone without waiting for its
+// mDNS records to expire
+#define HEARTBEAT_INTERVAL_MS (200)
+#define HEARTBEAT_TIMEOUT_MS (700)
+#define HEARTBEAT_MAX_PEERS (256)
+// Peers declared gone are still sent heartbeats this long, in case they are back
+#define HEARTBEAT_FORGET_TIME (300 * G_USEC_PER_SEC)
+// A returning peer's services are looked up again at most this often
+#define HEARTBEAT_REFRESH_HOLD (10 * G_USEC_PER_SEC)
+
+// Inline string storage for a pooled remote_service record. Machine ID names
+// and .local hostnames fit comfortably; longer strings get a one-off
+// allocation that is not recycled.
+#define REMOTE_SERVICE_POOL_STRINGS (128)
+#define REMOTE_SERVICE_POOL_MAX (64)
+
+/* What a host does when players arrive after its game started */
+enum late_join_policy {
+    // Re-host with everyone, restarting the running game
+    LATE_JOIN_RESTART,
+    // Late players wait for the next round, when the running game ends
+    LATE_JOIN_QUEUE,
+    // Late players start their own match if there are enough of them
+    LATE_JOIN_OVERFLOW,
+};
+
+static char const* const late_join_policy_names[] = {
+    [LATE_JOIN_RESTART] = "restart",
+    [LATE_JOIN_QUEUE] = "queue",
+    [LATE_JOIN_OVERFLOW] = "overflow",
+};
 
 static struct config {
     uint16_t port;
     char* zdoom;
+    char* cache_dir;
     char* mp_wad;
     char* mp_map;
     char* mp_config;
@@ -43,584 +130,2939 @@ static struct config {
     char* sp_config;
     bool can_host;
     int source_wait;
+    int source_min_wait;
+    int source_max_wait;
+    int host_switch_margin;
     int host_preference_override;
-} config;
-
-struct local_service {
-    AvahiEntryGroup* group;
-    char* service_name;
-    AvahiIfIndex interface;
+    int max_resolvers;
     AvahiProtocol protocol;
-    AvahiPublishFlags flags;
-    char* name;
-    char* type;
-    char* domain;
-    char* host;
-    uint16_t port;
-    AvahiStringList* txt_records;
-};
+    uint16_t probe_port;
+    bool low_chatter;
+    char** interfaces;
+    char** ignore_interfaces;
+    char** interface_priority;
+    char* backend;
+    // Log game launches instead of running zdoom
+    bool dry_run;
+    enum late_join_policy late_join;
+} config;
 
 static int timeout_source = 0;
+
+/*
+ * The source timer waits for the client set to be quiet for a window that
+ * grows with how often clients changed since the wait began, bounded by
+ * config.source_wait, while the whole wait is bounded by
+ * config.source_max_wait.
+ */
+static struct quiescence {
+    gint64 wait_started_at;
+    unsigned changes;
+} quiescence;
 static int child_source = 0;
 static GPid child_pid = 0;
-static AvahiClient* avahi_client;
+static struct discovery_backend const* const discovery_backends[] = {
+    &discovery_avahi,
+    &discovery_sim,
+};
+static struct discovery_backend const* backend = NULL;
 
 static struct local_service local_client_service = {};
 static struct local_service local_host_service = {};
 
+/*
+ * A resolved remote service instance. Each record is a single allocation:
+ * name and hostname are stored inline after the struct, while type, domain
+ * and wad are interned strings shared between all records. The successor,
+ * network and members change with every game, so they are owned by the
+ * record.
+ */
 struct remote_service {
-    TAILQ_ENTRY(remote_service) link;
+    union {
+        TAILQ_ENTRY(remote_service) peer_link;
+        SLIST_ENTRY(remote_service) free_link;
+    };
+    struct peer* peer;
     AvahiIfIndex interface;
     AvahiProtocol protocol;
     uint16_t port;
     char* name;
-    char* type;
-    char* domain;
+    char const* type;
+    char const* domain;
     char* hostname;
-    char* wad;
+    char const* wad;
     AvahiLookupResultFlags flags;
     int host_preference;
+    // The daemon advertised that its only links are wireless
+    bool wireless;
+    // Capability benchmark score, 0 for daemons that do not advertise one
+    int score;
+    // Advertised worst RTT to the daemon's peers in ms, 0 if unknown
+    int rtt;
+    // The daemon's board is hot, throttled or loaded
+    bool stressed;
+    int capacity;
+    // Name of the peer the host hands the game over to
+    char* successor;
+    // IPv4 network the daemon advertised, NULL if unknown
+    char* network;
+    // Match a host runs when the peers are split into several games
+    bool has_match;
+    uint32_t match;
+    // Players of the host's running game, see members_contains()
+    char* members;
+    int txt_version;
+    bool has_digest;
+    uint32_t digest;
+    // Not reported again yet during a discovery re-sync
+    bool stale;
+    bool has_address;
+    AvahiAddress address;
+    size_t strings_size;
+    char strings[];
+};
+
+static SLIST_HEAD(remote_service_pool, remote_service)
+    remote_service_pool = SLIST_HEAD_INITIALIZER(remote_service_pool);
+static int remote_service_pool_count = 0;
+
+/*
+ * A remote daemon's client or host service. The same service is usually
+ * discovered as several instances, one per interface and protocol it is
+ * reachable on; the election counts and ranks peers rather than instances.
+ */
+struct peer {
+    char* name;
+    char const* type;
+    GSequenceIter* election_iter;
+    // This peer's contribution to election.digest
+    uint32_t digest_part;
+    // Smoothed round trip time from this daemon in us, 0 if not measured
+    int rtt_us;
+    gint64 rtt_updated_at;
+    // Instance whose TXT data represents the peer
+    struct remote_service* primary;
+    TAILQ_HEAD(peer_instances, remote_service) instances;
+};
+
+enum election_result {
+    ELECTION_NO_SUITABLE_HOST,
+    ELECTION_NO_PEERS,
+    ELECTION_HOST_GAME,
+    ELECTION_WAIT_FOR_HOST,
+};
+
+/*
+ * Client peers ranked by cmp_remote_service on their primary instance (best
+ * first). The best candidate and the peer counts are updated incrementally as
+ * clients come and go, so deciding the election is constant time.
+ */
+static struct election {
+    GSequence* ranking;
+    struct remote_service* best;
+    int own_count;
+    int other_count;
+    enum election_result result;
+    // Membership digest of the ranked peers, see membership_hash()
+    uint32_t digest;
+} election;
+
+static struct stats {
+    unsigned txt_updates;
+    unsigned txt_invalid;
+    unsigned digest_updates;
+    unsigned digest_starts;
+    unsigned dirty_events;
+    unsigned dispatches;
+    unsigned probes_sent;
+    unsigned probe_replies;
+    unsigned probe_timeouts;
+    unsigned rtt_probes_sent;
+    unsigned rtt_replies;
+    unsigned heartbeats_sent;
+    unsigned heartbeats_received;
+    unsigned heartbeat_failures;
+    unsigned heartbeat_returns;
+    unsigned heartbeat_refreshes;
+    unsigned heartbeat_stalls;
+    gint64 heartbeat_detect_max;
+    unsigned stress_updates;
+    unsigned partitions;
+    unsigned other_match_hosts;
+    unsigned late_deferred;
+    unsigned late_joins;
+    gint64 late_wait_total;
+    gint64 late_wait_max;
+    unsigned successor_takeovers;
+    unsigned successor_joins;
+    unsigned successor_timeouts;
+    unsigned host_ready;
+    unsigned host_ready_timeouts;
+    gint64 host_ready_total;
+    gint64 host_ready_max;
+    unsigned stress_updates_held;
+    unsigned best_changes;
+    unsigned result_changes;
+    // Monotonic times used to measure how quickly the election converges
+    gint64 started_at;
+    gint64 last_change_at;
+    gint64 first_decision_at;
+    gint64 first_peer_at;
+    gint64 game_started_at;
+    unsigned source_wait_capped;
+    unsigned host_switches_avoided;
+} stats;
+
+/*
+ * Discovery callbacks only update the registry and mark what changed; the
+ * resulting action is computed once per main loop iteration by
+ * on_dispatch().
+ */
+enum dirty_flags {
+    // A non-own client peer was added, removed or changed preference
+    DIRTY_CLIENTS = (1 << 0),
+    // current_host changed, went away, or changed its game settings
+    DIRTY_HOST = (1 << 1),
+    // A client peer advertised a different membership digest
+    DIRTY_DIGEST = (1 << 2),
 };
 
-static TAILQ_HEAD(remote_service_head, remote_service)
-    client_service_list = TAILQ_HEAD_INITIALIZER(client_service_list);
+static unsigned dirty = 0;
+static guint dispatch_source = 0;
+
 static struct remote_service* current_host = NULL;
+// This daemon is running the multiplayer game as its host
+static bool hosting = false;
+
+/*
+ * A newly spawned host game is only advertised once it is listening, so
+ * clients do not try to join before it can answer.
+ */
+static struct host_ready {
+    guint source;
+    gint64 spawned_at;
+    // The host service is published
+    bool advertised;
+} host_ready;
+
+// Our own client TXT record values
+static int local_host_preference = 0;
+// Set by the health check while this board should not host
+static bool local_stressed = false;
+static gint64 stress_changed_at = 0;
+static int local_score = 0;
+static int local_rtt = 0;
+static char local_network[INET_ADDRSTRLEN + 4] = "";
+static bool local_wireless = false;
+// Digest currently advertised in our client TXT records
+static uint32_t published_digest = 0;
+// Successor currently advertised in our host TXT records
+static char* published_successor = NULL;
+// Players of the game we host, advertised in our host TXT records
+static char* game_members = NULL;
+static guint publish_source = 0;
 static bool single_player_running = false;
 
-static void create_service(AvahiClient* client, struct local_service* service);
+/*
+ * All resolved remote service instances (clients and hosts), keyed by name,
+ * type, domain, interface and protocol. The registry owns the records; peers,
+ * the election and current_host only borrow them.
+ */
+static GHashTable* remote_services = NULL;
+
+// Peers keyed by type and name, owning their struct peer
+static GHashTable* peers = NULL;
+
+struct probe_packet {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t token;
+};
+
+static int probe_fd = -1;
+static int probe_family = AF_UNSPEC;
+
+// A network path the current host can be joined over
+struct host_path {
+    AvahiAddress address;
+    AvahiIfIndex interface;
+};
+
+/*
+ * When the current host is reachable over several paths, each one is probed
+ * and the host is joined over the first to answer.
+ */
+static struct host_probe {
+    guint timeout_source;
+    uint32_t generation;
+    gint64 sent_at;
+    int count;
+    struct host_path paths[MAX_PROBE_PATHS];
+} host_probe;
+
+/*
+ * While a game is running its host advertises a successor: the best other
+ * candidate. When the host goes away, the successor hosts straight away and
+ * the other clients wait for it instead of starting a new election.
+ */
+static struct failover {
+    // Successor of the host that just went away
+    char* successor;
+    guint timeout_source;
+} failover;
+
+/*
+ * With more peers than zdoom takes in one game, they are split into several
+ * concurrent matches. Every board computes the same partition from the
+ * advertised records and keeps only its own match here.
+ */
+static struct match {
+    // The partition below reflects the current ranking
+    bool computed;
+    bool active;
+    // XOR of membership_hash() over the members, advertised by the host
+    uint32_t id;
+    int size;
+    char* host;
+    // Best other candidate in the match, NULL if none
+    char* successor;
+    char* members;
+} match;
+
+/*
+ * Set while a host runs a game without us, from when we first noticed.
+ * Cleared once we play multiplayer, which gives the late joiner's time to
+ * play.
+ */
+static struct late_join {
+    gint64 since;
+    // The host of our match whose game we are waiting for
+    char* host;
+} late_join;
+
+struct match_slot {
+    struct peer* peer;
+    int rank;
+    int group;
+};
+
+/*
+ * Round trip time probes to every client peer. Replies are matched to the
+ * peer by the token, which indexes the names probed in the current round.
+ */
+static struct rtt_probe {
+    guint source;
+    uint16_t generation;
+    gint64 sent_at;
+    GPtrArray* names;
+} rtt_probe;
+
+/*
+ * A peer's heartbeat state. The peer is identified in its heartbeats by
+ * membership_hash(name, 0), which also keys the heartbeat.peers table.
+ */
+struct heartbeat_peer {
+    char* name;
+    struct sockaddr_storage sa;
+    socklen_t len;
+    // 0 until the first heartbeat, so daemons that never send any (e.g.
+    // older versions) are only ever removed by mDNS
+    gint64 last_heard_at;
+    // When the peer was declared gone, 0 while it is alive
+    gint64 failed_at;
+    // When its services were last looked up again after it came back
+    gint64 refreshed_at;
+    unsigned round;
+};
+
+/*
+ * Heartbeats exchanged with every client peer over the probe socket. A board
+ * that loses power sends no mDNS goodbye, so without them its records would
+ * linger until their TTL runs out.
+ */
+static struct heartbeat {
+    guint source;
+    unsigned round;
+    gint64 last_round_at;
+    GHashTable* peers;
+} heartbeat;
+
+/*
+ * Peers and the elected host remembered from the previous session. Until the
+ * first election after startup, the source timer is shortened once all of
+ * these peers have been rediscovered and the same host would be elected
+ * again.
+ */
+static struct peer_cache {
+    GHashTable* peers;
+    char* host;
+    gint64 loaded_at;
+} peer_cache;
+
+// Address the running client was told to join, if it joined by address
+static bool joined_by_address = false;
+static AvahiAddress joined_address;
 
 static gboolean on_source_timeout(gpointer userdata);
 
-static void stop_service(struct local_service* service) {
-    if (service->group) {
-        g_print("Stopping service %s %s\n", service->name, service->type);
-        avahi_entry_group_reset(service->group);
-        avahi_entry_group_free(service->group);
-        service->group = NULL;
+static gboolean on_dispatch(gpointer userdata);
+
+static void mark_dirty(unsigned flags) {
+    dirty |= flags;
+    stats.dirty_events++;
+
+    if (!dispatch_source) {
+        dispatch_source = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, on_dispatch,
+                                          NULL, NULL);
     }
 }
 
+static void stop_service(struct local_service* service) {
+    backend->unpublish(service);
+}
+
 static void stop_source_timer(void) {
     if (timeout_source) {
         g_source_remove(timeout_source);
         timeout_source = 0;
     }
+    quiescence.wait_started_at = 0;
+}
+
+static bool warm_start_ready(void);
+
+/* Length of the quiet window in ms, given the churn seen so far */
+static gint64 quiet_window(gint64 now) {
+    gint64 min_wait = config.source_min_wait * 1000;
+    gint64 elapsed = MAX(now - quiescence.wait_started_at, min_wait * 1000);
+
+    // Stretch the window by the number of changes expected during it
+    gint64 expected = quiescence.changes * min_wait * 1000 / elapsed;
+    return MIN(min_wait * (1 + expected), (gint64)config.source_wait * 1000);
 }
 
 static void restart_source_timer(void) {
-    stop_source_timer();
-    timeout_source =
-        g_timeout_add(config.source_wait * 1000, on_source_timeout, NULL);
+    gint64 now = g_get_monotonic_time();
+    gint64 wait;
+
+    if (timeout_source) {
+        g_source_remove(timeout_source);
+        timeout_source = 0;
+    }
+
+    if (!quiescence.wait_started_at) {
+        quiescence.wait_started_at = now;
+        quiescence.changes = 0;
+    } else {
+        quiescence.changes++;
+    }
+
+    wait = quiet_window(now);
+    if (warm_start_ready()) {
+        wait = MIN(wait, WARM_START_WAIT * 1000);
+    }
+
+    gint64 deadline =
+        quiescence.wait_started_at + (gint64)config.source_max_wait * 1000000;
+    if (now + wait * 1000 > deadline) {
+        wait = MAX(deadline - now, 0) / 1000;
+        stats.source_wait_capped++;
+    }
+
+    timeout_source = g_timeout_add(wait, on_source_timeout, NULL);
+}
+
+static struct remote_service* remote_service_new(char const* name,
+                                                 char const* type,
+                                                 char const* domain,
+                                                 char const* hostname) {
+    size_t name_len = strlen(name) + 1;
+    size_t hostname_len = strlen(hostname) + 1;
+    size_t strings_size = name_len + hostname_len;
+    struct remote_service* service = NULL;
+
+    if (strings_size <= REMOTE_SERVICE_POOL_STRINGS) {
+        strings_size = REMOTE_SERVICE_POOL_STRINGS;
+        service = SLIST_FIRST(&remote_service_pool);
+        if (service) {
+            SLIST_REMOVE_HEAD(&remote_service_pool, free_link);
+            remote_service_pool_count--;
+        }
+    }
+
+    if (service == NULL) {
+        service = g_malloc(sizeof(*service) + strings_size);
+    }
+
+    memset(service, 0, sizeof(*service));
+    service->strings_size = strings_size;
+
+    service->name = memcpy(service->strings, name, name_len);
+    service->hostname =
+        memcpy(service->strings + name_len, hostname, hostname_len);
+    service->type = g_intern_string(type);
+    service->domain = g_intern_string(domain);
+
+    return service;
 }
 
 static void remote_service_free(struct remote_service* service) {
     if (service) {
-        g_free(service->name);
-        g_free(service->type);
-        g_free(service->domain);
-        g_free(service->hostname);
-        g_free(service->wad);
+        g_clear_pointer(&service->successor, g_free);
+        g_clear_pointer(&service->network, g_free);
+        g_clear_pointer(&service->members, g_free);
+
+        if (service->strings_size == REMOTE_SERVICE_POOL_STRINGS &&
+            remote_service_pool_count < REMOTE_SERVICE_POOL_MAX) {
+            SLIST_INSERT_HEAD(&remote_service_pool, service, free_link);
+            remote_service_pool_count++;
+            return;
+        }
 
         g_free(service);
     }
 }
 
-static bool remote_service_equal(struct remote_service const* a,
-                                 struct remote_service const* b) {
-    return (g_strcmp0(a->type, b->type) == 0) &&
-           (g_strcmp0(a->name, b->name) == 0) && a->interface == b->interface &&
-           a->protocol == b->protocol;
+static void remote_service_pool_clear(void) {
+    struct remote_service* service;
+
+    while ((service = SLIST_FIRST(&remote_service_pool)) != NULL) {
+        SLIST_REMOVE_HEAD(&remote_service_pool, free_link);
+        g_free(service);
+    }
+    remote_service_pool_count = 0;
 }
 
-static void on_child_exit(GPid pid, gint status, gpointer userdata);
+static guint service_key_hash(char const* name, char const* type,
+                              char const* domain, AvahiIfIndex interface,
+                              AvahiProtocol protocol) {
+    guint h = g_str_hash(name);
 
-static void kill_child(void) {
-    if (child_pid) {
-        g_print("Killing child %d\n", child_pid);
-        kill(child_pid, SIGINT);
-        waitpid(child_pid, NULL, 0);
-        child_pid = 0;
+    h = h * 31 + g_str_hash(type);
+    h = h * 31 + g_str_hash(domain);
+    h = h * 31 + (guint)interface;
+    h = h * 31 + (guint)protocol;
+    return h;
+}
+
+static guint remote_service_hash(gconstpointer p) {
+    struct remote_service const* s = p;
+    return service_key_hash(s->name, s->type, s->domain, s->interface,
+                            s->protocol);
+}
+
+static gboolean remote_service_equal(gconstpointer pa, gconstpointer pb) {
+    struct remote_service const* a = pa;
+    struct remote_service const* b = pb;
+
+    return a->interface == b->interface && a->protocol == b->protocol &&
+           (g_strcmp0(a->name, b->name) == 0) &&
+           (g_strcmp0(a->type, b->type) == 0) &&
+           (g_strcmp0(a->domain, b->domain) == 0);
+}
+
+static guint peer_hash(gconstpointer p) {
+    struct peer const* peer = p;
+    return g_str_hash(peer->name) * 31 + g_str_hash(peer->type);
+}
+
+static gboolean peer_equal(gconstpointer pa, gconstpointer pb) {
+    struct peer const* a = pa;
+    struct peer const* b = pb;
+
+    return (g_strcmp0(a->name, b->name) == 0) &&
+           (g_strcmp0(a->type, b->type) == 0);
+}
+
+static void peer_free(struct peer* peer) {
+    if (peer) {
+        g_free(peer->name);
+        g_free(peer);
     }
-    if (child_source) {
-        g_source_remove(child_source);
-        child_source = 0;
+}
+
+static struct remote_service* registry_lookup(char const* name,
+                                              char const* type,
+                                              char const* domain,
+                                              AvahiIfIndex interface,
+                                              AvahiProtocol protocol) {
+    // Only the key fields are read by the hash and equal functions
+    struct remote_service key = {
+        .name = (char*)name,
+        .type = type,
+        .domain = domain,
+        .interface = interface,
+        .protocol = protocol,
+    };
+
+    return g_hash_table_lookup(remote_services, &key);
+}
+
+static bool is_client_service(struct remote_service const* service) {
+    return g_strcmp0(service->type, CLIENT_SERVICE_NAME) == 0;
+}
+
+static int cmp_remote_service(struct remote_service* const a,
+                              struct remote_service* const b) {
+    int ret = (a->host_preference > 0) - (b->host_preference > 0);
+    if (ret) {
+        return ret;
+    }
+
+    ret = a->host_preference - b->host_preference;
+    if (ret) {
+        return ret;
+    }
+
+    // Among equally preferred hosts a healthy one hosts before a stressed one
+    if (a->stressed != b->stressed) {
+        return a->stressed ? -1 : 1;
+    }
+
+    // Hosts on a wired link keep game traffic off the wireless network,
+    // which matters more for latency than a faster board
+    if (a->wireless != b->wireless) {
+        return a->wireless ? -1 : 1;
+    }
+
+    /*
+     * Among equally preferred hosts the most capable board runs the game.
+     * Scores come in coarse steps, so boards of the same model tie here.
+     */
+    if (a->score != b->score) {
+        return a->score < b->score ? -1 : 1;
+    }
+
+    /*
+     * The host closest to its farthest player keeps latency down for all; a
+     * host that does not know its RTT sorts last. RTTs are only known some
+     * seconds after startup, so they come last: learning them can only
+     * reorder hosts the keys above left tied.
+     */
+    if (a->rtt != b->rtt) {
+        if (!a->rtt || !b->rtt) {
+            return a->rtt ? 1 : -1;
+        }
+        return a->rtt < b->rtt ? 1 : -1;
+    }
+
+    return g_strcmp0(a->name, b->name);
+}
+
+static gint cmp_election_rank(gconstpointer a, gconstpointer b,
+                              gpointer userdata) {
+    struct peer const* pa = a;
+    struct peer const* pb = b;
+
+    // Best candidate sorts first
+    return cmp_remote_service(pb->primary, pa->primary);
+}
+
+static bool is_own_service(struct remote_service const* service) {
+    return (service->flags & AVAHI_LOOKUP_RESULT_OUR_OWN) != 0;
+}
+
+static char const* election_result_str(enum election_result result) {
+    switch (result) {
+        case ELECTION_NO_SUITABLE_HOST:
+            return "no suitable hosts";
+        case ELECTION_NO_PEERS:
+            return "no peers";
+        case ELECTION_HOST_GAME:
+            return "host game";
+        case ELECTION_WAIT_FOR_HOST:
+            return "wait for host";
+    }
+    return "unknown";
+}
+
+/* The client peer of the host running the current game, if still present */
+static struct remote_service* election_incumbent(void) {
+    char const* name;
+
+    if (hosting) {
+        name = local_client_service.name;
+    } else if (current_host) {
+        name = current_host->name;
+    } else {
+        return NULL;
+    }
+
+    struct peer key = {.name = (char*)name, .type = CLIENT_SERVICE_NAME};
+    struct peer* peer = g_hash_table_lookup(peers, &key);
+    return peer && peer->election_iter ? peer->primary : NULL;
+}
+
+/*
+ * The host the election settles on. A running game keeps its host unless the
+ * best candidate's preference beats it by config.host_switch_margin, so a
+ * board booting or winning only on a tie breaker mid-session does not restart
+ * the game everywhere. A host that becomes stressed is not replaced either: the
+ * host board is the one most likely to run hot, and it only loses the game
+ * at the next election without a running game. Every board sees the same advertised host service, so they all keep the
+ * same incumbent.
+ */
+static struct remote_service* election_winner(void) {
+    struct remote_service* best = election.best;
+    struct remote_service* incumbent = election_incumbent();
+
+    if (best && incumbent && incumbent != best &&
+        incumbent->host_preference &&
+        best->host_preference - incumbent->host_preference <
+            config.host_switch_margin) {
+        return incumbent;
+    }
+    return best;
+}
+
+static enum election_result election_decide(void) {
+    struct remote_service* best = election_winner();
+
+    if (best == NULL || !best->host_preference) {
+        return ELECTION_NO_SUITABLE_HOST;
+    }
+
+    if (!is_own_service(best)) {
+        return ELECTION_WAIT_FOR_HOST;
+    }
+
+    return election.other_count ? ELECTION_HOST_GAME : ELECTION_NO_PEERS;
+}
+
+/*
+ * Re-evaluates the election after a membership change. This is cheap, so it
+ * is done on every change; acting on the result is still left to
+ * on_source_timeout().
+ */
+static void election_update(void) {
+    struct remote_service* best = NULL;
+
+    match.computed = false;
+
+    if (!g_sequence_is_empty(election.ranking)) {
+        struct peer* peer =
+            g_sequence_get(g_sequence_get_begin_iter(election.ranking));
+        best = peer->primary;
+    }
+
+    if (best != election.best) {
+        g_print("Best host candidate is now %s\n",
+                best ? best->name : "(none)");
+        election.best = best;
+        stats.best_changes++;
+        stats.last_change_at = g_get_monotonic_time();
+    }
+
+    enum election_result result = election_decide();
+    if (result != election.result) {
+        g_print("Election result changed to '%s' (%d own, %d other)\n",
+                election_result_str(result), election.own_count,
+                election.other_count);
+        election.result = result;
+        stats.result_changes++;
+        stats.last_change_at = g_get_monotonic_time();
+    }
+}
+
+static void election_add(struct peer* peer) {
+    peer->election_iter = g_sequence_insert_sorted(election.ranking, peer,
+                                                   cmp_election_rank, NULL);
+    peer->digest_part =
+        membership_hash(peer->name, peer->primary->host_preference);
+    election.digest ^= peer->digest_part;
+
+    if (is_own_service(peer->primary)) {
+        election.own_count++;
+    } else {
+        election.other_count++;
+        if (!stats.first_peer_at) {
+            stats.first_peer_at = g_get_monotonic_time();
+        }
+    }
+
+    election_update();
+}
+
+static void election_remove(struct peer* peer) {
+    if (peer->election_iter == NULL) {
+        return;
+    }
+
+    g_sequence_remove(peer->election_iter);
+    peer->election_iter = NULL;
+    election.digest ^= peer->digest_part;
+
+    if (is_own_service(peer->primary)) {
+        election.own_count--;
+    } else {
+        election.other_count--;
+    }
+
+    election_update();
+}
+
+/* Re-sorts a peer in the election after its primary instance changed */
+static void election_changed(struct peer* peer) {
+    if (peer->election_iter) {
+        g_sequence_sort_changed(peer->election_iter, cmp_election_rank, NULL);
+        election.digest ^= peer->digest_part;
+        peer->digest_part =
+            membership_hash(peer->name, peer->primary->host_preference);
+        election.digest ^= peer->digest_part;
+        election_update();
     }
 }
 
-static void spawn_child(char** argv) {
-    kill_child();
-
-    GError* error = NULL;
+/*
+ * Adds a service instance to the registry, attaching it to its peer. Returns
+ * true if this is the first instance of a new peer.
+ */
+static bool registry_add(struct remote_service* service) {
+    struct peer key = {.name = service->name, .type = service->type};
+    struct peer* peer = g_hash_table_lookup(peers, &key);
+    bool new_peer = (peer == NULL);
+
+    g_hash_table_add(remote_services, service);
+
+    if (new_peer) {
+        peer = g_new0(struct peer, 1);
+        peer->name = g_strdup(service->name);
+        peer->type = service->type;
+        peer->primary = service;
+        TAILQ_INIT(&peer->instances);
+        g_hash_table_add(peers, peer);
+    }
+
+    TAILQ_INSERT_TAIL(&peer->instances, service, peer_link);
+    service->peer = peer;
+    interface_peer_add(service->interface, service->name);
+
+    if (interface_cmp(service->interface, peer->primary->interface) < 0) {
+        peer->primary = service;
+    }
+
+    if (new_peer && is_client_service(service)) {
+        election_add(peer);
+    }
+
+    return new_peer;
+}
+
+/*
+ * Removes a service instance from the registry and frees it. If it was the
+ * last instance of its peer, the peer is removed from the election and freed
+ * too, and true is returned. Otherwise another instance becomes the primary
+ * if needed. The caller is responsible for updating current_host.
+ */
+static bool registry_remove(struct remote_service* service) {
+    struct peer* peer = service->peer;
+    bool peer_removed = false;
+
+    TAILQ_REMOVE(&peer->instances, service, peer_link);
+    interface_peer_remove(service->interface, service->name);
+
+    if (TAILQ_EMPTY(&peer->instances)) {
+        election_remove(peer);
+        g_hash_table_remove(peers, peer);
+        peer_removed = true;
+    } else if (peer->primary == service) {
+        struct remote_service* instance;
+
+        // The instance on the preferred interface represents the peer
+        peer->primary = TAILQ_FIRST(&peer->instances);
+        TAILQ_FOREACH(instance, &peer->instances, peer_link) {
+            if (interface_cmp(instance->interface,
+                              peer->primary->interface) < 0) {
+                peer->primary = instance;
+            }
+        }
+        election_changed(peer);
+    }
+
+    g_hash_table_remove(remote_services, service);
+    return peer_removed;
+}
+
+static char* peer_cache_path(void) {
+    return g_build_filename(config.cache_dir, PEER_CACHE_FILE, NULL);
+}
+
+static void parse_peer_cache_line(char const* line, size_t len) {
+    char buf[PEER_CACHE_MAX_LINE];
+    char name[PEER_CACHE_MAX_LINE];
+    int pref;
+
+    if (len >= sizeof(buf)) {
+        return;
+    }
+    memcpy(buf, line, len);
+    buf[len] = '\0';
+
+    if (sscanf(buf, "peer %255s %d", name, &pref) == 2) {
+        g_hash_table_insert(peer_cache.peers, g_strdup(name),
+                            GINT_TO_POINTER(pref));
+    } else if (sscanf(buf, "host %255s", name) == 1) {
+        g_free(peer_cache.host);
+        peer_cache.host = g_strdup(name);
+    }
+}
+
+/*
+ * Loads the peer cache written by a previous run. The file is small and
+ * line based:
+ *
+ *   oe-doom-peers <version>
+ *   peer <name> <host preference>
+ *   host <name>
+ */
+static void load_peer_cache(void) {
+    g_autofree char* path = peer_cache_path();
+    g_autoptr(GError) error = NULL;
+
+    peer_cache.peers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                             NULL);
+
+    g_autoptr(GMappedFile) file = g_mapped_file_new(path, FALSE, &error);
+    if (file == NULL) {
+        g_debug("No peer cache: %s", error->message);
+        return;
+    }
+
+    char const* data = g_mapped_file_get_contents(file);
+    size_t size = g_mapped_file_get_length(file);
+    char const* end = data + size;
+    bool header = true;
+
+    while (data && data < end) {
+        char const* eol = memchr(data, '\n', end - data);
+        size_t len = (eol ? eol : end) - data;
+
+        if (header) {
+            int version;
+            char buf[PEER_CACHE_MAX_LINE];
+
+            memcpy(buf, data, MIN(len, sizeof(buf) - 1));
+            buf[MIN(len, sizeof(buf) - 1)] = '\0';
+            if (sscanf(buf, "oe-doom-peers %d", &version) != 1 ||
+                version != PEER_CACHE_VERSION) {
+                g_warning("Ignoring peer cache %s with unknown format", path);
+                return;
+            }
+            header = false;
+        } else {
+            parse_peer_cache_line(data, len);
+        }
+
+        data += len + 1;
+    }
+
+    peer_cache.loaded_at = g_get_monotonic_time();
+    g_print("Loaded %u cached peers (last host %s)\n",
+            g_hash_table_size(peer_cache.peers),
+            peer_cache.host ? peer_cache.host : "(none)");
+}
+
+/* Atomically replaces the peer cache with the current view */
+static void save_peer_cache(char const* host) {
+    if (config.dry_run) {
+        return;
+    }
+
+    g_autofree char* path = peer_cache_path();
+    g_autoptr(GError) error = NULL;
+    GString* contents = g_string_new(NULL);
+
+    g_string_append_printf(contents, "oe-doom-peers %d\n", PEER_CACHE_VERSION);
+
+    GSequenceIter* iter = g_sequence_get_begin_iter(election.ranking);
+    for (; !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter)) {
+        struct peer* peer = g_sequence_get(iter);
+        if (!is_own_service(peer->primary)) {
+            g_string_append_printf(contents, "peer %s %d\n", peer->name,
+                                   peer->primary->host_preference);
+        }
+    }
+
+    if (host) {
+        g_string_append_printf(contents, "host %s\n", host);
+    }
+
+    if (g_mkdir_with_parents(config.cache_dir, 0755) < 0 ||
+        !g_file_set_contents(path, contents->str, contents->len, &error)) {
+        g_warning("Cannot write peer cache %s: %s", path,
+                  error ? error->message : g_strerror(errno));
+    }
+
+    g_string_free(contents, TRUE);
+}
+
+/* Forgets the cached peers once the first election has been decided */
+static void end_warm_start(void) {
+    g_clear_pointer(&peer_cache.peers, g_hash_table_destroy);
+    g_clear_pointer(&peer_cache.host, g_free);
+}
+
+static bool warm_start_ready(void) {
+    if (peer_cache.peers == NULL || g_hash_table_size(peer_cache.peers) == 0) {
+        return false;
+    }
+
+    GHashTableIter iter;
+    gpointer name;
+    g_hash_table_iter_init(&iter, peer_cache.peers);
+    while (g_hash_table_iter_next(&iter, &name, NULL)) {
+        struct peer key = {.name = name, .type = CLIENT_SERVICE_NAME};
+        if (!g_hash_table_contains(peers, &key)) {
+            return false;
+        }
+    }
+
+    if (peer_cache.host &&
+        (election.best == NULL ||
+         g_strcmp0(election.best->name, peer_cache.host) != 0)) {
+        return false;
+    }
+
+    g_print("All %u cached peers seen again after %" G_GINT64_FORMAT
+            " ms, shortening wait\n",
+            g_hash_table_size(peer_cache.peers),
+            (g_get_monotonic_time() - peer_cache.loaded_at) / 1000);
+    return true;
+}
+
+static void on_child_exit(GPid pid, gint status, gpointer userdata);
+
+static void kill_child(void) {
+    if (child_pid) {
+        g_print("Killing child %d\n", child_pid);
+        kill(child_pid, SIGINT);
+        waitpid(child_pid, NULL, 0);
+        child_pid = 0;
+    }
+    if (child_source) {
+        g_source_remove(child_source);
+        child_source = 0;
+    }
+}
+
+static void spawn_child(char** argv) {
+    kill_child();
+
+    GError* error = NULL;
+
+    g_print("Launching");
+
+    for (int i = 0; argv[i] != NULL; i++) {
+        g_print(" %s", argv[i]);
+    }
+
+    g_print("\n");
+
+    if (config.dry_run) {
+        return;
+    }
+
+    if (!g_spawn_async(NULL, argv, NULL,
+                       G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD, NULL,
+                       NULL, &child_pid, &error)) {
+        g_error("Cannot spawn child process: %m");
+        g_clear_error(&error);
+        return;
+    }
+
+    g_print("Child PID is %d\n", child_pid);
+
+    child_source = g_child_watch_add(child_pid, on_child_exit, NULL);
+}
+
+static void stop_hosting(void) {
+    if (host_ready.source) {
+        g_source_remove(host_ready.source);
+        host_ready.source = 0;
+    }
+    host_ready.advertised = false;
+    stop_service(&local_host_service);
+    hosting = false;
+}
+
+static void launch_single_player(void) {
+    stop_hosting();
+    if (!single_player_running) {
+        g_print("Launching single player game\n");
+        g_autoptr(GStrvBuilder) sb = g_strv_builder_new();
+
+        g_strv_builder_add(sb, config.zdoom);
+        g_strv_builder_add(sb, "-iwad");
+        g_strv_builder_add(sb, config.sp_wad);
+        if (config.sp_config) {
+            g_strv_builder_add(sb, "-config");
+            g_strv_builder_add(sb, config.sp_config);
+        }
+
+        g_auto(GStrv) argv = g_strv_builder_end(sb);
+        spawn_child(argv);
+        single_player_running = true;
+    }
+}
+
+/*
+ * Formats the address zdoom should join for a host when none of its host
+ * service instances has an IPv4 address (e.g. it was only resolved over
+ * IPv6): an IPv4 address its client service was resolved to, or as a last
+ * resort the hostname itself. zdoom only speaks IPv4, so other addresses are
+ * not usable.
+ */
+static void format_join_address(struct remote_service const* host, char* buf,
+                                size_t size) {
+    struct peer key = {.name = host->name, .type = CLIENT_SERVICE_NAME};
+    struct peer* client = g_hash_table_lookup(peers, &key);
+    struct remote_service* instance;
+
+    if (client) {
+        TAILQ_FOREACH(instance, &client->instances, peer_link) {
+            if (instance->has_address &&
+                instance->address.proto == AVAHI_PROTO_INET) {
+                avahi_address_snprint(buf, size, &instance->address);
+                return;
+            }
+        }
+    }
+
+    g_strlcpy(buf, host->hostname, size);
+}
+
+static void record_game_start(void) {
+    gint64 now = g_get_monotonic_time();
+
+    if (!stats.game_started_at) {
+        stats.game_started_at = now;
+    }
+
+    if (late_join.since) {
+        gint64 wait = now - late_join.since;
+
+        g_print("Late join: playing after %" G_GINT64_FORMAT " ms\n",
+                wait / 1000);
+        stats.late_joins++;
+        stats.late_wait_total += wait;
+        stats.late_wait_max = MAX(stats.late_wait_max, wait);
+        late_join.since = 0;
+        g_clear_pointer(&late_join.host, g_free);
+    }
+}
+
+static void connect_to_host(AvahiAddress const* address) {
+    char port_str[12];
+    char join_address[AVAHI_DOMAIN_NAME_MAX];
+
+    stop_hosting();
+    if (address) {
+        avahi_address_snprint(join_address, sizeof(join_address), address);
+        joined_address = *address;
+        joined_by_address = true;
+    } else {
+        format_join_address(current_host, join_address, sizeof(join_address));
+        joined_by_address = false;
+    }
+    g_print("Connecting to host %s (%s):%d\n", current_host->hostname,
+            join_address, current_host->port);
+
+    g_autoptr(GStrvBuilder) sb = g_strv_builder_new();
+
+    g_strv_builder_add(sb, config.zdoom);
+    g_strv_builder_add(sb, "-iwad");
+    g_strv_builder_add(sb, current_host->wad);
+    g_strv_builder_add(sb, "-join");
+    g_strv_builder_add(sb, join_address);
+    g_strv_builder_add(sb, "-port");
+    snprintf(port_str, sizeof(port_str), "%d", current_host->port);
+    g_strv_builder_add(sb, port_str);
+    if (config.mp_config) {
+        g_strv_builder_add(sb, "-config");
+        g_strv_builder_add(sb, config.mp_config);
+    }
+
+    g_auto(GStrv) argv = g_strv_builder_end(sb);
+    spawn_child(argv);
+    single_player_running = false;
+    record_game_start();
+}
+
+static void add_member(GString* members, char const* name) {
+    g_string_append_printf(members, "%s%08x", members->len ? "," : "",
+                           membership_hash(name, 0));
+}
+
+/* The members list for a game of the best ranked peers */
+static char* ranking_members(void) {
+    GString* members = g_string_new(NULL);
+    int count = 0;
+
+    GSequenceIter* iter = g_sequence_get_begin_iter(election.ranking);
+    for (; !g_sequence_iter_is_end(iter) && count < MAX_PLAYERS;
+         iter = g_sequence_iter_next(iter), count++) {
+        struct peer* peer = g_sequence_get(iter);
+        add_member(members, peer->name);
+    }
+
+    return g_string_free(members, FALSE);
+}
+
+/*
+ * Orders peers so that those close to each other on the network are next to
+ * each other: wired before wireless, then by advertised network, then by
+ * election rank.
+ */
+static int cmp_match_locality(void const* pa, void const* pb) {
+    struct match_slot const* a = pa;
+    struct match_slot const* b = pb;
+    struct remote_service const* sa = a->peer->primary;
+    struct remote_service const* sb = b->peer->primary;
+
+    if (sa->wireless != sb->wireless) {
+        return sa->wireless ? 1 : -1;
+    }
+
+    if (g_strcmp0(sa->network, sb->network) != 0) {
+        if (!sa->network || !sb->network) {
+            return sa->network ? -1 : 1;
+        }
+        return strcmp(sa->network, sb->network);
+    }
+
+    return a->rank - b->rank;
+}
+
+static int cmp_match_rank(void const* pa, void const* pb) {
+    struct match_slot const* a = pa;
+    struct match_slot const* b = pb;
+
+    return a->rank - b->rank;
+}
+
+/*
+ * Splits the peers into the fewest matches of at most MAX_PLAYERS. Peers are
+ * grouped by locality into matches of about equal size, each hosted by its
+ * best ranked candidate. If that leaves a match without a candidate, the
+ * best candidates host instead and the other peers are dealt out to them in
+ * rank order. Peers that do not fit in any match get no group. The slots
+ * are left in rank order.
+ */
+static int partition_peers(struct match_slot* slots, int count) {
+    int groups = (count + MAX_PLAYERS - 1) / MAX_PLAYERS;
+    int candidates = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (slots[i].peer->primary->host_preference > 0) {
+            candidates++;
+        }
+    }
+    groups = MIN(groups, candidates);
+    if (groups == 0) {
+        return 0;
+    }
+
+    qsort(slots, count, sizeof(*slots), cmp_match_locality);
+
+    int base = count / groups;
+    int extra = count % groups;
+    int index = 0;
+    bool hosted = true;
+
+    for (int g = 0; g < groups; g++) {
+        int size = base + (g < extra ? 1 : 0);
+        bool has_candidate = false;
+
+        for (int i = 0; i < size; i++, index++) {
+            slots[index].group = i < MAX_PLAYERS ? g : -1;
+            if (slots[index].group == g &&
+                slots[index].peer->primary->host_preference > 0) {
+                has_candidate = true;
+            }
+        }
+        hosted = hosted && has_candidate;
+    }
+
+    qsort(slots, count, sizeof(*slots), cmp_match_rank);
+    if (hosted) {
+        return groups;
+    }
+
+    // The best candidates host instead
+    int hosts = 0;
+    int dealt = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct match_slot* slot = &slots[i];
+
+        slot->group = -1;
+        if (hosts < groups && slot->peer->primary->host_preference > 0) {
+            slot->group = hosts++;
+        } else if (dealt < groups * (MAX_PLAYERS - 1)) {
+            slot->group = dealt++ % groups;
+        }
+    }
+
+    return groups;
+}
+
+/*
+ * Recomputes the partition and our match in it. Returns false if all peers
+ * fit in one game.
+ */
+static bool update_match(void) {
+    int count = election.own_count + election.other_count;
+
+    match.computed = true;
+    g_clear_pointer(&match.host, g_free);
+    g_clear_pointer(&match.successor, g_free);
+    g_clear_pointer(&match.members, g_free);
+    match.active = count > MAX_PLAYERS;
+    match.id = 0;
+    match.size = 0;
+    if (!match.active) {
+        return false;
+    }
+
+    g_autofree struct match_slot* slots = g_new(struct match_slot, count);
+    int n = 0;
+
+    GSequenceIter* iter = g_sequence_get_begin_iter(election.ranking);
+    for (; !g_sequence_iter_is_end(iter) && n < count;
+         iter = g_sequence_iter_next(iter)) {
+        slots[n].peer = g_sequence_get(iter);
+        slots[n].rank = n;
+        slots[n].group = -1;
+        n++;
+    }
+
+    int groups = partition_peers(slots, n);
+    int own_group = -1;
+
+    for (int i = 0; i < n; i++) {
+        if (is_own_service(slots[i].peer->primary)) {
+            own_group = slots[i].group;
+        }
+    }
+
+    // Best ranked first, so the host and then the successor come first
+    struct remote_service* members[MAX_PLAYERS];
+    int size = 0;
+
+    for (int i = 0; i < n && own_group >= 0 && size < MAX_PLAYERS; i++) {
+        if (slots[i].group == own_group) {
+            members[size++] = slots[i].peer->primary;
+        }
+    }
+
+    stats.partitions++;
+    g_print("Split %d peers into %d matches; ours has %d players\n", n,
+            groups, size);
+
+    GString* names = g_string_new(NULL);
+    for (int i = 0; i < size; i++) {
+        match.id ^= membership_hash(members[i]->name,
+                                    members[i]->host_preference);
+        add_member(names, members[i]->name);
+    }
+    match.members = g_string_free(names, FALSE);
+    match.size = size;
+    if (size && members[0]->host_preference > 0) {
+        match.host = g_strdup(members[0]->name);
+    }
+    for (int i = 1; i < size; i++) {
+        if (members[i]->host_preference > 0) {
+            match.successor = g_strdup(members[i]->name);
+            break;
+        }
+    }
+
+    return true;
+}
+
+/* Whether peers are split into matches, partitioning again if needed */
+static bool current_match(void) {
+    if (!match.computed) {
+        update_match();
+    }
+    return match.active;
+}
+
+/*
+ * Whether a newly seen host runs our match. Every host is fine while all
+ * peers fit in one game. In low-chatter mode boards do not see the same
+ * preferences and networks, so they cannot compute the same partition; the
+ * host's members list decides instead, as it does when our own view has no
+ * host for us.
+ */
+static bool match_accepts(struct remote_service const* host) {
+    if (!current_match()) {
+        return true;
+    }
+
+    if (config.low_chatter || match.host == NULL) {
+        return host->members == NULL ||
+               members_contains(host->members, local_client_service.name);
+    }
+
+    return (host->has_match && host->match == match.id) ||
+           g_strcmp0(host->name, match.host) == 0;
+}
+
+static void clear_late_join(void) {
+    late_join.since = 0;
+    g_clear_pointer(&late_join.host, g_free);
+}
+
+/*
+ * Stops waiting for a host's running game once that host has gone or is no
+ * longer part of our match. Returns true if we stopped waiting.
+ */
+static bool check_late_join(void) {
+    if (!late_join.host) {
+        return false;
+    }
+
+    struct peer key = {.name = late_join.host, .type = HOST_SERVICE_NAME};
+    struct peer* host = g_hash_table_lookup(peers, &key);
+    if (host && match_accepts(host->primary)) {
+        return false;
+    }
+
+    g_print("No longer waiting for the game of %s\n", late_join.host);
+    clear_late_join();
+    return true;
+}
+
+/* The best candidate other than us to take over hosting, NULL if none */
+static char const* election_successor(void) {
+    if (match.active) {
+        return match.successor;
+    }
+
+    GSequenceIter* iter = g_sequence_get_begin_iter(election.ranking);
+    for (; !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter)) {
+        struct peer* peer = g_sequence_get(iter);
+
+        if (!is_own_service(peer->primary) &&
+            peer->primary->host_preference > 0) {
+            return peer->name;
+        }
+    }
+    return NULL;
+}
+
+static void rebuild_host_txt(void) {
+    AvahiStringList* txt = NULL;
+
+    g_free(published_successor);
+    published_successor = g_strdup(election_successor());
+
+    txt = avahi_string_list_add_printf(txt, "%s=%d", TXT_VERSION_KEY,
+                                       TXT_VERSION);
+    txt = avahi_string_list_add_pair(txt, WAD_KEY, config.mp_wad);
+    txt = avahi_string_list_add_printf(txt, "%s=%d", CAPACITY_KEY,
+                                       MAX_PLAYERS);
+    if (published_successor) {
+        txt = avahi_string_list_add_pair(txt, SUCCESSOR_KEY,
+                                         published_successor);
+    }
+    if (match.active) {
+        txt = avahi_string_list_add_printf(txt, "%s=%08x", MATCH_KEY,
+                                           match.id);
+    }
+    if (game_members) {
+        txt = avahi_string_list_add_pair(txt, MEMBERS_KEY, game_members);
+    }
+
+    avahi_string_list_free(local_host_service.txt_records);
+    local_host_service.txt_records = txt;
+}
+
+/* Publishes the host service, or re-announces its TXT records */
+static void advertise_host(void) {
+    if (host_ready.advertised) {
+        backend->update_txt(&local_host_service);
+    } else {
+        backend->publish(&local_host_service);
+        host_ready.advertised = true;
+    }
+}
+
+static gboolean on_host_ready_poll(gpointer userdata) {
+    gint64 elapsed = g_get_monotonic_time() - host_ready.spawned_at;
+
+    if (listening_udp(child_pid, config.port)) {
+        g_print("Host game ready after %" G_GINT64_FORMAT " ms\n",
+                elapsed / 1000);
+        stats.host_ready++;
+        stats.host_ready_total += elapsed;
+        stats.host_ready_max = MAX(stats.host_ready_max, elapsed);
+    } else if (elapsed >= HOST_READY_TIMEOUT) {
+        g_warning("Host game is not listening on port %d, advertising it "
+                  "anyway",
+                  config.port);
+        stats.host_ready_timeouts++;
+    } else {
+        return G_SOURCE_CONTINUE;
+    }
+
+    host_ready.source = 0;
+    advertise_host();
+    return G_SOURCE_REMOVE;
+}
+
+/* Advertises the game just spawned once it is listening */
+static void wait_for_host_ready(void) {
+    if (host_ready.source) {
+        g_source_remove(host_ready.source);
+        host_ready.source = 0;
+    }
+
+    // Dry runs have no child to wait for
+    if (!child_pid) {
+        advertise_host();
+        return;
+    }
+
+    host_ready.spawned_at = g_get_monotonic_time();
+    host_ready.source =
+        g_timeout_add(HOST_READY_POLL_MS, on_host_ready_poll, NULL);
+}
+
+/* Hosts a game for num_players; takes ownership of the members list */
+static void host_game(int num_players, char* members) {
+    g_print("Hosting game for %d players\n", num_players);
+    g_free(game_members);
+    game_members = members;
+    char count_str[12];
+    g_autoptr(GStrvBuilder) sb = g_strv_builder_new();
+
+    g_strv_builder_add(sb, config.zdoom);
+    g_strv_builder_add(sb, "-iwad");
+    g_strv_builder_add(sb, config.mp_wad);
+    g_strv_builder_add(sb, "-deathmatch");
+    g_strv_builder_add(sb, "+map");
+    g_strv_builder_add(sb, config.mp_map);
+    g_strv_builder_add(sb, "-host");
+    snprintf(count_str, sizeof(count_str), "%i", num_players);
+    g_strv_builder_add(sb, count_str);
+    g_strv_builder_add(sb, "-port");
+    snprintf(count_str, sizeof(count_str), "%i", config.port);
+    g_strv_builder_add(sb, count_str);
+    if (config.mp_config) {
+        g_strv_builder_add(sb, "-config");
+        g_strv_builder_add(sb, config.mp_config);
+    }
+
+    g_auto(GStrv) argv = g_strv_builder_end(sb);
+    spawn_child(argv);
+
+    single_player_running = false;
+    record_game_start();
+
+    rebuild_host_txt();
+    hosting = true;
+    wait_for_host_ready();
+}
+
+static void on_child_exit(GPid pid, gint status, gpointer userdata) {
+    g_print("Child %d exited with %d\n", pid, status);
+    g_spawn_close_pid(pid);
+    if (pid != child_pid) {
+        return;
+    }
+    child_source = 0;
+
+    single_player_running = false;
+    launch_single_player();
+}
+
+static bool address_to_sockaddr(AvahiAddress const* address,
+                                AvahiIfIndex interface, uint16_t port,
+                                struct sockaddr_storage* sa, socklen_t* len) {
+    memset(sa, 0, sizeof(*sa));
+
+    if (probe_family == AF_INET6) {
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6*)sa;
+
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        if (address->proto == AVAHI_PROTO_INET) {
+            // IPv4-mapped address on the dual stack socket
+            sin6->sin6_addr.s6_addr[10] = 0xff;
+            sin6->sin6_addr.s6_addr[11] = 0xff;
+            memcpy(&sin6->sin6_addr.s6_addr[12], &address->data.ipv4.address,
+                   4);
+        } else {
+            memcpy(&sin6->sin6_addr, address->data.ipv6.address, 16);
+            if (IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr) && interface > 0) {
+                sin6->sin6_scope_id = interface;
+            }
+        }
+        *len = sizeof(*sin6);
+        return true;
+    }
+
+    if (probe_family == AF_INET && address->proto == AVAHI_PROTO_INET) {
+        struct sockaddr_in* sin = (struct sockaddr_in*)sa;
+
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        sin->sin_addr.s_addr = address->data.ipv4.address;
+        *len = sizeof(*sin);
+        return true;
+    }
+
+    return false;
+}
+
+static void cancel_host_probe(void) {
+    if (host_probe.timeout_source) {
+        g_source_remove(host_probe.timeout_source);
+        host_probe.timeout_source = 0;
+    }
+}
+
+static gboolean on_host_probe_timeout(gpointer userdata) {
+    host_probe.timeout_source = 0;
+    stats.probe_timeouts++;
+
+    g_print("No path probe replies from %s, using its primary path\n",
+            current_host->name);
+    connect_to_host(&host_probe.paths[0].address);
+    return G_SOURCE_REMOVE;
+}
+
+/* Whether a datagram came from the probe port at the address */
+static bool probe_sender_is(struct sockaddr_storage const* from,
+                            AvahiAddress const* address,
+                            AvahiIfIndex interface) {
+    struct sockaddr_storage sa;
+    socklen_t len;
+
+    if (!address_to_sockaddr(address, interface, config.probe_port, &sa,
+                             &len) ||
+        from->ss_family != sa.ss_family) {
+        return false;
+    }
+
+    if (sa.ss_family == AF_INET6) {
+        struct sockaddr_in6 const* a = (struct sockaddr_in6 const*)from;
+        struct sockaddr_in6 const* b = (struct sockaddr_in6 const*)&sa;
+
+        return a->sin6_port == b->sin6_port &&
+               IN6_ARE_ADDR_EQUAL(&a->sin6_addr, &b->sin6_addr);
+    }
+
+    struct sockaddr_in const* a = (struct sockaddr_in const*)from;
+    struct sockaddr_in const* b = (struct sockaddr_in const*)&sa;
+
+    return a->sin_port == b->sin_port &&
+           a->sin_addr.s_addr == b->sin_addr.s_addr;
+}
+
+static void handle_probe_reply(uint32_t token,
+                               struct sockaddr_storage const* from) {
+    int index = token & 0xff;
+
+    if (!host_probe.timeout_source ||
+        (token >> 8) != (host_probe.generation & 0xffffff) ||
+        index >= host_probe.count ||
+        !probe_sender_is(from, &host_probe.paths[index].address,
+                         host_probe.paths[index].interface)) {
+        return;
+    }
+
+    stats.probe_replies++;
+    cancel_host_probe();
+
+    char a[AVAHI_ADDRESS_STR_MAX];
+    avahi_address_snprint(a, sizeof(a), &host_probe.paths[index].address);
+    g_print("Fastest path to host %s is %s on interface %d (%" G_GINT64_FORMAT
+            " us)\n",
+            current_host->name, a, host_probe.paths[index].interface,
+            g_get_monotonic_time() - host_probe.sent_at);
+
+    connect_to_host(&host_probe.paths[index].address);
+}
+
+static void handle_rtt_reply(uint32_t token) {
+    guint index = token & 0xffff;
+
+    if (rtt_probe.names == NULL || (token >> 16) != rtt_probe.generation ||
+        index >= rtt_probe.names->len) {
+        return;
+    }
+
+    // Each probe is answered once; later duplicates are ignored
+    g_autofree char* name = g_ptr_array_index(rtt_probe.names, index);
+    g_ptr_array_index(rtt_probe.names, index) = NULL;
+    if (name == NULL) {
+        return;
+    }
+
+    struct peer key = {.name = name, .type = CLIENT_SERVICE_NAME};
+    struct peer* peer = g_hash_table_lookup(peers, &key);
+    if (peer == NULL) {
+        return;
+    }
+
+    gint64 now = g_get_monotonic_time();
+    int sample = MAX(now - rtt_probe.sent_at, 1);
+
+    stats.rtt_replies++;
+    peer->rtt_us = peer->rtt_us ? (7 * peer->rtt_us + sample) / 8 : sample;
+    peer->rtt_updated_at = now;
+}
+
+static void handle_heartbeat(uint32_t id) {
+    struct heartbeat_peer* hb;
+    gint64 now = g_get_monotonic_time();
+
+    // Heartbeats from peers not discovered yet are ignored
+    if (heartbeat.peers == NULL ||
+        (hb = g_hash_table_lookup(heartbeat.peers, GUINT_TO_POINTER(id))) ==
+            NULL) {
+        return;
+    }
+
+    stats.heartbeats_received++;
+    hb->last_heard_at = now;
+    if (!hb->failed_at) {
+        return;
+    }
+
+    /*
+     * The peer was declared gone but is alive (e.g. it rebooted, or its
+     * heartbeats were lost). avahi-daemon may still have its records cached
+     * and will not report them again by itself, so look them up again.
+     */
+    hb->failed_at = now;
+    if (hb->refreshed_at && now - hb->refreshed_at < HEARTBEAT_REFRESH_HOLD) {
+        return;
+    }
+    g_print("Heard from %s again, looking up its services\n", hb->name);
+    hb->refreshed_at = now;
+    stats.heartbeat_refreshes++;
+    backend->refresh(hb->name);
+}
+
+static gboolean on_probe_readable(gint fd, GIOCondition condition,
+                                  gpointer userdata) {
+    struct probe_packet packet;
+    struct sockaddr_storage sa;
+    socklen_t len;
+    ssize_t size;
+
+    for (;;) {
+        len = sizeof(sa);
+        size = recvfrom(fd, &packet, sizeof(packet), 0, (struct sockaddr*)&sa,
+                        &len);
+        if (size < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                g_warning("Probe socket receive failed: %m");
+            }
+            break;
+        }
+
+        if (size != sizeof(packet) || ntohl(packet.magic) != PROBE_MAGIC) {
+            continue;
+        }
+
+        switch (ntohl(packet.type)) {
+            case PROBE_ECHO_REQUEST:
+                packet.type = htonl(PROBE_ECHO_REPLY);
+                sendto(fd, &packet, sizeof(packet), 0, (struct sockaddr*)&sa,
+                       len);
+                break;
+
+            case PROBE_ECHO_REPLY:
+                handle_probe_reply(ntohl(packet.token), &sa);
+                break;
+
+            case PROBE_RTT_REQUEST:
+                packet.type = htonl(PROBE_RTT_REPLY);
+                sendto(fd, &packet, sizeof(packet), 0, (struct sockaddr*)&sa,
+                       len);
+                break;
+
+            case PROBE_RTT_REPLY:
+                handle_rtt_reply(ntohl(packet.token));
+                break;
+
+            case PROBE_HEARTBEAT:
+                handle_heartbeat(ntohl(packet.token));
+                break;
+        }
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static bool open_probe_socket(void) {
+    struct sockaddr_storage sa = {};
+    socklen_t len;
+
+    if (config.protocol != AVAHI_PROTO_INET) {
+        probe_fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0);
+    }
+
+    if (probe_fd >= 0) {
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&sa;
+        int v6only = (config.protocol == AVAHI_PROTO_INET6);
+
+        setsockopt(probe_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only,
+                   sizeof(v6only));
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(config.probe_port);
+        sin6->sin6_addr = in6addr_any;
+        len = sizeof(*sin6);
+        probe_family = AF_INET6;
+    } else {
+        struct sockaddr_in* sin = (struct sockaddr_in*)&sa;
+
+        probe_fd =
+            socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (probe_fd < 0) {
+            g_warning("Cannot create probe socket: %m");
+            return false;
+        }
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(config.probe_port);
+        sin->sin_addr.s_addr = htonl(INADDR_ANY);
+        len = sizeof(*sin);
+        probe_family = AF_INET;
+    }
+
+    if (bind(probe_fd, (struct sockaddr*)&sa, len) < 0) {
+        g_warning("Cannot bind probe socket to port %d: %m",
+                  config.probe_port);
+        close(probe_fd);
+        probe_fd = -1;
+        return false;
+    }
+
+    g_unix_fd_add(probe_fd, G_IO_IN, on_probe_readable, NULL);
+    return true;
+}
+
+static bool host_path_available(void) {
+    if (!joined_by_address) {
+        return true;
+    }
+
+    struct remote_service* instance;
+    TAILQ_FOREACH(instance, &current_host->peer->instances, peer_link) {
+        if (instance->has_address &&
+            avahi_address_cmp(&instance->address, &joined_address) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Collects the distinct IPv4 paths to the current host, ordered by
+ * interface preference starting with its primary instance. If the host can
+ * be reached over a wired link, wireless paths are left out.
+ */
+static int collect_host_paths(struct host_path* paths, int max) {
+    int count = 0;
+    struct remote_service* instance;
+
+    TAILQ_FOREACH(instance, &current_host->peer->instances, peer_link) {
+        if (!instance->has_address ||
+            instance->address.proto != AVAHI_PROTO_INET) {
+            continue;
+        }
+
+        bool duplicate = false;
+        for (int i = 0; i < count; i++) {
+            if (paths[i].interface == instance->interface &&
+                avahi_address_cmp(&paths[i].address, &instance->address) ==
+                    0) {
+                duplicate = true;
+                break;
+            }
+        }
+
+        if (!duplicate && count < max) {
+            paths[count].address = instance->address;
+            paths[count].interface = instance->interface;
+            if (instance == current_host && count) {
+                struct host_path tmp = paths[0];
+                paths[0] = paths[count];
+                paths[count] = tmp;
+            }
+            count++;
+        }
+    }
+
+    // Stable insertion sort; there are at most MAX_PROBE_PATHS paths
+    for (int i = 1; i < count; i++) {
+        struct host_path path = paths[i];
+        int j = i;
+
+        for (; j > 0; j--) {
+            if (interface_cmp(path.interface, paths[j - 1].interface) >= 0) {
+                break;
+            }
+            paths[j] = paths[j - 1];
+        }
+        paths[j] = path;
+    }
+
+    if (count && !interface_is_wireless(paths[0].interface)) {
+        while (count > 1 && interface_is_wireless(paths[count - 1].interface)) {
+            count--;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Joins the current host. If it is reachable over more than one path, each
+ * path is probed first and the one with the lowest round trip time is used.
+ */
+static void select_host_path(void) {
+    struct sockaddr_storage sa;
+    socklen_t len;
+    int sent = 0;
+
+    host_probe.count =
+        collect_host_paths(host_probe.paths, G_N_ELEMENTS(host_probe.paths));
+
+    if (host_probe.count == 0) {
+        connect_to_host(NULL);
+        return;
+    }
+
+    if (host_probe.count == 1 || probe_fd < 0) {
+        connect_to_host(&host_probe.paths[0].address);
+        return;
+    }
+
+    host_probe.generation++;
+    host_probe.sent_at = g_get_monotonic_time();
+
+    for (int i = 0; i < host_probe.count; i++) {
+        struct probe_packet packet = {
+            .magic = htonl(PROBE_MAGIC),
+            .type = htonl(PROBE_ECHO_REQUEST),
+            .token = htonl(((host_probe.generation & 0xffffff) << 8) | i),
+        };
+
+        if (!address_to_sockaddr(&host_probe.paths[i].address,
+                                 host_probe.paths[i].interface,
+                                 config.probe_port, &sa, &len)) {
+            continue;
+        }
+
+        if (sendto(probe_fd, &packet, sizeof(packet), 0, (struct sockaddr*)&sa,
+                   len) == sizeof(packet)) {
+            stats.probes_sent++;
+            sent++;
+        }
+    }
+
+    if (!sent) {
+        connect_to_host(&host_probe.paths[0].address);
+        return;
+    }
+
+    g_print("Probing %d paths to host %s\n", host_probe.count,
+            current_host->name);
+    host_probe.timeout_source =
+        g_timeout_add(PROBE_TIMEOUT_MS, on_host_probe_timeout, NULL);
+}
+
+/*
+ * Late players that are not part of any running game start an overflow
+ * match of their own, provided there are at least two of them and one can
+ * host. Otherwise they wait for the next round.
+ */
+static void decide_overflow(void) {
+    GPtrArray* running = g_ptr_array_new();
+    struct remote_service* players[MAX_PLAYERS];
+    int count = 0;
+    GHashTableIter iter;
+    struct remote_service* service;
+
+    g_hash_table_iter_init(&iter, remote_services);
+    while (g_hash_table_iter_next(&iter, (gpointer*)&service, NULL)) {
+        if (!is_client_service(service) && service->members) {
+            g_ptr_array_add(running, (gpointer)service->members);
+        }
+    }
+
+    GSequenceIter* rank = g_sequence_get_begin_iter(election.ranking);
+    for (; !g_sequence_iter_is_end(rank) && count < MAX_PLAYERS;
+         rank = g_sequence_iter_next(rank)) {
+        struct peer* peer = g_sequence_get(rank);
+        bool playing = false;
+
+        for (guint i = 0; i < running->len && !playing; i++) {
+            playing = members_contains(g_ptr_array_index(running, i),
+                                       peer->name);
+        }
+        if (!playing) {
+            players[count++] = peer->primary;
+        }
+    }
+    g_ptr_array_free(running, TRUE);
+
+    if (count < 2 || !players[0]->host_preference) {
+        g_print("Queued for the next round with %d late players\n", count);
+        return;
+    }
+
+    if (!is_own_service(players[0])) {
+        g_print("Waiting for overflow match host %s\n", players[0]->name);
+        return;
+    }
+
+    GString* members = g_string_new(NULL);
+    for (int i = 0; i < count; i++) {
+        add_member(members, players[i]->name);
+    }
+    g_print("Hosting an overflow match for %d late players\n", count);
+    host_game(count, g_string_free(members, FALSE));
+}
+
+/*
+ * Applies config.late_join. Returns true if it settled what to do, in which
+ * case the election result is not acted on.
+ */
+static bool decide_late_join(void) {
+    char const* policy = late_join_policy_names[config.late_join];
+
+    if (hosting) {
+        if (config.late_join == LATE_JOIN_RESTART) {
+            return false;
+        }
+        g_print("Keeping the running game for the next round (late-join %s)\n",
+                policy);
+        stats.late_deferred++;
+        return true;
+    }
+
+    if (!late_join.since || current_host || check_late_join()) {
+        return false;
+    }
+
+    switch (config.late_join) {
+        case LATE_JOIN_RESTART:
+            g_print("Waiting for the host to restart its game\n");
+            break;
+
+        case LATE_JOIN_QUEUE:
+            g_print("Queued for the next round\n");
+            break;
+
+        case LATE_JOIN_OVERFLOW:
+            decide_overflow();
+            break;
+    }
+    return true;
+}
+
+/* Acts on the election result, ending the wait for peers */
+static void decide_election(void) {
+    if (!stats.first_decision_at) {
+        stats.first_decision_at = g_get_monotonic_time();
+    }
+
+    if (decide_late_join()) {
+        return;
+    }
+
+    enum election_result result = election_decide();
+    struct remote_service* winner = election_winner();
+    int players = election.other_count + 1;
+
+    if ((result == ELECTION_HOST_GAME || result == ELECTION_WAIT_FOR_HOST) &&
+        current_match()) {
+        struct peer key = {.name = match.host, .type = CLIENT_SERVICE_NAME};
+        struct peer* host =
+            match.host ? g_hash_table_lookup(peers, &key) : NULL;
+
+        if (host == NULL) {
+            result = ELECTION_NO_SUITABLE_HOST;
+        } else {
+            winner = host->primary;
+            players = match.size;
+            result = is_own_service(winner) ? ELECTION_HOST_GAME
+                                            : ELECTION_WAIT_FOR_HOST;
+        }
+    }
+
+    if (winner && winner != election.best && !match.active) {
+        g_print("Keeping %s as host over %s\n", winner->name,
+                election.best->name);
+        stats.host_switches_avoided++;
+    }
+
+    end_warm_start();
+    if (result == ELECTION_HOST_GAME || result == ELECTION_WAIT_FOR_HOST) {
+        save_peer_cache(winner->name);
+    }
+
+    switch (result) {
+        case ELECTION_HOST_GAME:
+            g_print("This is the best host (worst RTT %d ms). Hosting for %i "
+                    "clients....\n",
+                    winner->rtt, players - 1);
+            host_game(players, match.active ? g_strdup(match.members)
+                                            : ranking_members());
+            break;
+
+        case ELECTION_NO_PEERS:
+            g_print("No peers found\n");
+            launch_single_player();
+            break;
+
+        case ELECTION_WAIT_FOR_HOST:
+            g_print("Best host is %s (worst RTT %d ms)\n", winner->hostname,
+                    winner->rtt);
+            // No change here; wait for the host to start the game
+            break;
+
+        case ELECTION_NO_SUITABLE_HOST:
+            g_print("No suitable hosts\n");
+            launch_single_player();
+            break;
+    }
+}
+
+static gboolean on_source_timeout(gpointer userdata) {
+    g_print("Source timeout after %" G_GINT64_FORMAT " ms, %u changes\n",
+            (g_get_monotonic_time() - quiescence.wait_started_at) / 1000,
+            quiescence.changes);
+
+    timeout_source = 0;
+    quiescence.wait_started_at = 0;
+    decide_election();
+    return FALSE;
+}
+
+static void rebuild_client_txt(void) {
+    AvahiStringList* txt = NULL;
+
+    txt = avahi_string_list_add_printf(txt, "%s=%d", TXT_VERSION_KEY,
+                                       TXT_VERSION);
+    txt = avahi_string_list_add_printf(txt, "%s=%d", HOST_PREF_KEY,
+                                       local_host_preference);
+    txt = avahi_string_list_add_pair(
+        txt, LINK_KEY, local_wireless ? LINK_WIRELESS : LINK_WIRED);
+    if (local_stressed) {
+        txt = avahi_string_list_add_printf(txt, "%s=1", STRESSED_KEY);
+    }
+    if (local_score > 0) {
+        txt = avahi_string_list_add_printf(txt, "%s=%d", SCORE_KEY,
+                                           local_score);
+    }
+    if (local_rtt > 0) {
+        txt = avahi_string_list_add_printf(txt, "%s=%d", RTT_KEY, local_rtt);
+    }
+    if (local_network[0]) {
+        txt = avahi_string_list_add_pair(txt, NETWORK_KEY, local_network);
+    }
+    txt = avahi_string_list_add_printf(txt, "%s=%08x", DIGEST_KEY,
+                                       published_digest);
+
+    avahi_string_list_free(local_client_service.txt_records);
+    local_client_service.txt_records = txt;
+}
+
+/*
+ * While waiting for the source timer, the best host starts the game as
+ * soon as every other peer advertises the same membership digest as we do:
+ * they all see the same peers with the same preferences, so waiting longer
+ * would not change the outcome.
+ */
+static void check_digest_agreement(void) {
+    if (!timeout_source || election_decide() != ELECTION_HOST_GAME ||
+        published_digest != election.digest) {
+        return;
+    }
+
+    GSequenceIter* iter = g_sequence_get_begin_iter(election.ranking);
+    for (; !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter)) {
+        struct peer* peer = g_sequence_get(iter);
+        struct remote_service* primary = peer->primary;
+
+        if (!is_own_service(primary) &&
+            (!primary->has_digest || primary->digest != election.digest)) {
+            return;
+        }
+    }
+
+    g_print("All %d peers agree on membership %08x, not waiting any longer\n",
+            election.other_count, election.digest);
+    stats.digest_starts++;
+    stop_source_timer();
+    decide_election();
+}
+
+static gboolean on_publish_txt(gpointer userdata) {
+    bool digest_changed = published_digest != election.digest;
+
+    publish_source = 0;
+    published_digest = election.digest;
+    rebuild_client_txt();
+    backend->update_txt(&local_client_service);
+
+    if (hosting &&
+        g_strcmp0(published_successor, election_successor()) != 0) {
+        rebuild_host_txt();
+        // Otherwise it goes out with the game once that is ready
+        if (!host_ready.source) {
+            backend->update_txt(&local_host_service);
+        }
+        g_print("Successor is now %s\n",
+                published_successor ? published_successor : "(none)");
+    }
+
+    if (digest_changed) {
+        stats.digest_updates++;
+        check_digest_agreement();
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/* Re-announces our TXT records soon, batching further changes */
+static void schedule_txt_update(void) {
+    if (!publish_source) {
+        publish_source =
+            g_timeout_add(DIGEST_PUBLISH_DELAY_MS, on_publish_txt, NULL);
+    }
+}
+
+/*
+ * Advertises the worst recent RTT to our peers, rounded up to RTT_BUCKET_MS.
+ * Peers that never answer (e.g. older daemons) are left out.
+ */
+static void update_local_rtt(void) {
+    gint64 cutoff = g_get_monotonic_time() -
+                    (gint64)RTT_MAX_AGE_ROUNDS * RTT_PROBE_INTERVAL_MS * 1000;
+    int worst_us = 0;
+
+    GSequenceIter* iter = g_sequence_get_begin_iter(election.ranking);
+    for (; !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter)) {
+        struct peer* peer = g_sequence_get(iter);
+
+        if (peer->rtt_us && peer->rtt_updated_at >= cutoff) {
+            worst_us = MAX(worst_us, peer->rtt_us);
+        }
+    }
+
+    int bucket_us = RTT_BUCKET_MS * 1000;
+    int rtt = worst_us ? (worst_us + bucket_us - 1) / bucket_us * RTT_BUCKET_MS
+                       : 0;
+    if (rtt != local_rtt &&
+        (!rtt || !local_rtt || ABS(rtt - local_rtt) > RTT_HYSTERESIS_MS)) {
+        g_print("Worst RTT to peers is now %d ms\n", rtt);
+        local_rtt = rtt;
+        schedule_txt_update();
+    }
+}
+
+static gboolean on_rtt_probe_round(gpointer userdata) {
+    struct sockaddr_storage sa;
+    socklen_t len;
+
+    update_local_rtt();
+
+    g_ptr_array_set_size(rtt_probe.names, 0);
+    rtt_probe.generation++;
+    rtt_probe.sent_at = g_get_monotonic_time();
+
+    GSequenceIter* iter = g_sequence_get_begin_iter(election.ranking);
+    for (; !g_sequence_iter_is_end(iter) &&
+           rtt_probe.names->len < RTT_MAX_PROBES;
+         iter = g_sequence_iter_next(iter)) {
+        struct peer* peer = g_sequence_get(iter);
+        struct remote_service* primary = peer->primary;
+        struct probe_packet packet = {
+            .magic = htonl(PROBE_MAGIC),
+            .type = htonl(PROBE_RTT_REQUEST),
+            .token = htonl((uint32_t)rtt_probe.generation << 16 |
+                           rtt_probe.names->len),
+        };
+
+        if (is_own_service(primary) || !primary->has_address ||
+            !address_to_sockaddr(&primary->address, primary->interface,
+                                 config.probe_port, &sa, &len)) {
+            continue;
+        }
+
+        if (sendto(probe_fd, &packet, sizeof(packet), 0, (struct sockaddr*)&sa,
+                   len) == sizeof(packet)) {
+            g_ptr_array_add(rtt_probe.names, g_strdup(peer->name));
+            stats.rtt_probes_sent++;
+        }
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * A hot, throttled or loaded board advertises that it is stressed until it
+ * has recovered. Every healthy candidate ranks ahead of it and takes over a
+ * game it hosts, whatever the preferences.
+ */
+static gboolean on_health_check(gpointer userdata) {
+    bool stressed = health_check();
+    gint64 now = g_get_monotonic_time();
+
+    if (stressed == local_stressed) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (stress_changed_at &&
+        now - stress_changed_at < HEALTH_STRESS_HOLD * G_USEC_PER_SEC) {
+        stats.stress_updates_held++;
+        return G_SOURCE_CONTINUE;
+    }
+
+    g_print("Advertising that this board is %s\n",
+            stressed ? "stressed" : "healthy again");
+    local_stressed = stressed;
+    stress_changed_at = now;
+    stats.stress_updates++;
+    schedule_txt_update();
+    return G_SOURCE_CONTINUE;
+}
+
+static void start_rtt_probes(void) {
+    rtt_probe.names = g_ptr_array_new_with_free_func(g_free);
+    rtt_probe.source =
+        g_timeout_add(RTT_PROBE_INTERVAL_MS, on_rtt_probe_round, NULL);
+}
+
+static void cancel_failover(void) {
+    if (failover.timeout_source) {
+        g_source_remove(failover.timeout_source);
+        failover.timeout_source = 0;
+    }
+}
+
+static gboolean on_successor_timeout(gpointer userdata) {
+    failover.timeout_source = 0;
+    stats.successor_timeouts++;
+
+    g_print("Successor did not take over, starting a new election\n");
+    launch_single_player();
+    restart_source_timer();
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Hands the game over to the successor of the host that just went away.
+ * Returns false if there is none to hand over to, or if we are the successor
+ * but nobody is left to play with.
+ */
+static bool fail_over(void) {
+    g_autofree char* successor = g_steal_pointer(&failover.successor);
+
+    cancel_failover();
+    if (successor == NULL) {
+        return false;
+    }
+
+    if (g_strcmp0(successor, local_client_service.name) == 0) {
+        // Counted from live peers; the match still lists the departed host
+        if (!election.other_count) {
+            g_print("Host went away and no other players are left\n");
+            return false;
+        }
+
+        g_print("Host went away, taking over as its successor\n");
+        stats.successor_takeovers++;
+        stop_source_timer();
+        if (current_match()) {
+            host_game(match.size, g_strdup(match.members));
+        } else {
+            host_game(election.other_count + 1, ranking_members());
+        }
+        return true;
+    }
+
+    struct peer key = {.name = (char*)successor, .type = CLIENT_SERVICE_NAME};
+    if (!g_hash_table_contains(peers, &key)) {
+        return false;
+    }
+
+    g_print("Host went away, waiting for its successor %s\n", successor);
+    stats.successor_joins++;
+    stop_source_timer();
+    failover.timeout_source =
+        g_timeout_add(SUCCESSOR_TIMEOUT_MS, on_successor_timeout, NULL);
+    return true;
+}
+
+static gboolean on_dispatch(gpointer userdata) {
+    unsigned flags = dirty;
 
-    g_print("Launching");
+    dirty = 0;
+    dispatch_source = 0;
+    stats.dispatches++;
 
-    for (int i = 0; argv[i] != NULL; i++) {
-        g_print(" %s", argv[i]);
+    if (flags & DIRTY_CLIENTS) {
+        restart_source_timer();
     }
 
-    g_print("\n");
+    if (election.digest != published_digest ||
+        (hosting &&
+         g_strcmp0(published_successor, election_successor()) != 0)) {
+        schedule_txt_update();
+    }
 
-    if (!g_spawn_async(NULL, argv, NULL,
-                       G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD, NULL,
-                       NULL, &child_pid, &error)) {
-        g_error("Cannot spawn child process: %m");
-        g_clear_error(&error);
-        return;
+    if (flags & DIRTY_HOST) {
+        cancel_host_probe();
+        if (current_host) {
+            cancel_failover();
+            end_warm_start();
+            save_peer_cache(current_host->name);
+            select_host_path();
+            stop_source_timer();
+        } else if (!fail_over()) {
+            launch_single_player();
+            restart_source_timer();
+        }
     }
 
-    g_print("Child PID is %d\n", child_pid);
+    if (flags & (DIRTY_CLIENTS | DIRTY_DIGEST)) {
+        check_digest_agreement();
+    }
 
-    child_source = g_child_watch_add(child_pid, on_child_exit, NULL);
+    return G_SOURCE_REMOVE;
 }
 
-static void launch_single_player(void) {
-    stop_service(&local_host_service);
-    if (!single_player_running) {
-        g_print("Launching single player game\n");
-        g_autoptr(GStrvBuilder) sb = g_strv_builder_new();
+/*
+ * Removes a service instance that went away, updating current_host and
+ * marking what changed. Losing one of several instances of a peer is not a
+ * membership change.
+ */
+static void remove_remote_service(struct remote_service* service) {
+    struct peer* peer = service->peer;
+    bool is_host = current_host && current_host->peer == peer;
+    bool is_other_client =
+        is_client_service(service) && !is_own_service(service);
+
+    if (is_client_service(service) &&
+        TAILQ_FIRST(&peer->instances) == service &&
+        TAILQ_NEXT(service, peer_link) == NULL) {
+        g_print("Removing client %s\n", service->name);
+    }
 
-        g_strv_builder_add(sb, config.zdoom);
-        g_strv_builder_add(sb, "-iwad");
-        g_strv_builder_add(sb, config.sp_wad);
-        if (config.sp_config) {
-            g_strv_builder_add(sb, "-config");
-            g_strv_builder_add(sb, config.sp_config);
-        }
+    // current_host may be the instance that is freed
+    g_autofree char* successor =
+        is_host ? g_strdup(current_host->successor) : NULL;
+    bool is_late_join_host = !is_client_service(service) &&
+                             g_strcmp0(service->name, late_join.host) == 0;
 
-        g_auto(GStrv) argv = g_strv_builder_end(sb);
-        spawn_child(argv);
-        single_player_running = true;
+    if (registry_remove(service)) {
+        if (is_other_client) {
+            mark_dirty(DIRTY_CLIENTS);
+        }
+        if (is_late_join_host) {
+            g_print("Host %s we were waiting for went away\n",
+                    late_join.host);
+            clear_late_join();
+            restart_source_timer();
+        }
+        if (is_host) {
+            cancel_host_probe();
+            current_host = NULL;
+            g_free(failover.successor);
+            failover.successor = g_steal_pointer(&successor);
+            mark_dirty(DIRTY_HOST);
+        }
+    } else if (is_host) {
+        current_host = peer->primary;
+        if (!host_path_available()) {
+            mark_dirty(DIRTY_HOST);
+        }
     }
 }
 
-static void connect_to_host(void) {
-    char port_str[12];
-    stop_service(&local_host_service);
-    g_print("Connecting to host %s:%d\n", current_host->hostname,
-            current_host->port);
-
-    g_autoptr(GStrvBuilder) sb = g_strv_builder_new();
-
-    g_strv_builder_add(sb, config.zdoom);
-    g_strv_builder_add(sb, "-iwad");
-    g_strv_builder_add(sb, current_host->wad);
-    g_strv_builder_add(sb, "-join");
-    g_strv_builder_add(sb, current_host->hostname);
-    g_strv_builder_add(sb, "-port");
-    snprintf(port_str, sizeof(port_str), "%d", current_host->port);
-    g_strv_builder_add(sb, port_str);
-    if (config.mp_config) {
-        g_strv_builder_add(sb, "-config");
-        g_strv_builder_add(sb, config.mp_config);
+/*
+ * Applies a re-resolved record (e.g. a TXT record change) to an existing
+ * service in place, repositioning it in the election if its preference
+ * changed.
+ */
+static void update_remote_service(struct remote_service* service,
+                                  struct remote_service const* update) {
+    bool wad_changed = service->wad != update->wad;
+    bool port_changed = service->port != update->port;
+    bool pref_changed = service->host_preference != update->host_preference ||
+                        service->stressed != update->stressed;
+    // Link metrics only break ties between equally preferred hosts
+    bool metrics_changed = service->wireless != update->wireless ||
+                           service->score != update->score ||
+                           service->rtt != update->rtt;
+    bool address_changed =
+        update->has_address &&
+        (!service->has_address ||
+         avahi_address_cmp(&service->address, &update->address) != 0);
+    bool digest_changed = service->has_digest != update->has_digest ||
+                          service->digest != update->digest;
+    bool members_changed = g_strcmp0(service->members, update->members) != 0;
+
+    service->flags = update->flags;
+    service->port = update->port;
+    service->wad = update->wad;
+    service->capacity = update->capacity;
+    g_free(service->successor);
+    service->successor = g_strdup(update->successor);
+    if (g_strcmp0(service->network, update->network) != 0) {
+        // Locality of the partition
+        match.computed = false;
+        g_free(service->network);
+        service->network = g_strdup(update->network);
+    }
+    service->has_match = update->has_match;
+    service->match = update->match;
+    if (members_changed) {
+        g_free(service->members);
+        service->members = g_strdup(update->members);
+    }
+    service->txt_version = update->txt_version;
+    service->has_digest = update->has_digest;
+    service->digest = update->digest;
+    if (update->has_address) {
+        service->has_address = true;
+        service->address = update->address;
     }
 
-    g_auto(GStrv) argv = g_strv_builder_end(sb);
-    spawn_child(argv);
-    single_player_running = false;
-}
+    if (address_changed && current_host &&
+        current_host->peer == service->peer && !host_path_available()) {
+        g_print("Host %s changed address\n", service->name);
+        mark_dirty(DIRTY_HOST);
+    }
 
-static void host_game(int num_players) {
-    g_print("Hosting game for %d players\n", num_players);
-    char count_str[12];
-    g_autoptr(GStrvBuilder) sb = g_strv_builder_new();
+    if (digest_changed && is_client_service(service)) {
+        mark_dirty(DIRTY_DIGEST);
+    }
 
-    g_strv_builder_add(sb, config.zdoom);
-    g_strv_builder_add(sb, "-iwad");
-    g_strv_builder_add(sb, config.mp_wad);
-    g_strv_builder_add(sb, "-deathmatch");
-    g_strv_builder_add(sb, "+map");
-    g_strv_builder_add(sb, config.mp_map);
-    g_strv_builder_add(sb, "-host");
-    snprintf(count_str, sizeof(count_str), "%i", num_players);
-    g_strv_builder_add(sb, count_str);
-    g_strv_builder_add(sb, "-port");
-    snprintf(count_str, sizeof(count_str), "%i", config.port);
-    g_strv_builder_add(sb, count_str);
-    if (config.mp_config) {
-        g_strv_builder_add(sb, "-config");
-        g_strv_builder_add(sb, config.mp_config);
+    // A host that restarted its game to let us in
+    if (members_changed && !is_client_service(service) && !current_host &&
+        !hosting && !is_own_service(service) && service->members &&
+        members_contains(service->members, local_client_service.name)) {
+        g_print("Host %s let us into its game\n", service->name);
+        current_host = service->peer->primary;
+        mark_dirty(DIRTY_HOST);
     }
 
-    g_auto(GStrv) argv = g_strv_builder_end(sb);
-    spawn_child(argv);
+    if (!wad_changed && !port_changed && !pref_changed && !metrics_changed) {
+        return;
+    }
 
-    single_player_running = false;
+    stats.txt_updates++;
 
-    create_service(avahi_client, &local_host_service);
-}
+    if (service->host_preference != update->host_preference) {
+        g_print("Service %s host-preference changed %d -> %d\n",
+                service->name, service->host_preference,
+                update->host_preference);
+    }
+    if (service->stressed != update->stressed) {
+        g_print("Service %s is %s\n", service->name,
+                update->stressed ? "stressed" : "no longer stressed");
+    }
 
-static void on_child_exit(GPid pid, gint status, gpointer userdata) {
-    g_print("Child %d exited with %d\n", pid, status);
-    g_spawn_close_pid(pid);
-    if (pid != child_pid) {
-        return;
+    service->host_preference = update->host_preference;
+    service->stressed = update->stressed;
+    service->wireless = update->wireless;
+    service->score = update->score;
+    service->rtt = update->rtt;
+
+    if ((pref_changed || metrics_changed) &&
+        service->peer->primary == service && service->peer->election_iter) {
+        election_changed(service->peer);
+
+        /*
+         * Metrics such as the RTT are re-announced as they drift; they only
+         * re-sort the ranking and are no reason to wait for the network to
+         * settle again
+         */
+        if (pref_changed && !is_own_service(service)) {
+            mark_dirty(DIRTY_CLIENTS);
+        }
     }
-    child_source = 0;
 
-    single_player_running = false;
-    launch_single_player();
+    if (service == current_host &&
+        (wad_changed || port_changed || members_changed)) {
+        g_print("Host %s changed game settings\n", service->name);
+        mark_dirty(DIRTY_HOST);
+    }
 }
 
-static gboolean on_source_timeout(gpointer userdata) {
-    g_print("Source timeout\n");
-    int other_count = 0;
+/*
+ * Removes every instance of a peer's client and host services, as if all of
+ * them had sent an mDNS goodbye.
+ */
+static void remove_failed_peer(char const* name) {
+    static char const* const types[] = {CLIENT_SERVICE_NAME,
+                                        HOST_SERVICE_NAME};
 
-    // Count number of (non-self) client services
-    struct remote_service* client;
-    TAILQ_FOREACH(client, &client_service_list, link) {
-        if ((client->flags & AVAHI_LOOKUP_RESULT_OUR_OWN) == 0) {
-            other_count++;
+    for (size_t i = 0; i < G_N_ELEMENTS(types); i++) {
+        struct peer key = {.name = (char*)name, .type = types[i]};
+        struct peer* peer;
+
+        while ((peer = g_hash_table_lookup(peers, &key)) != NULL) {
+            remove_remote_service(TAILQ_FIRST(&peer->instances));
         }
     }
+}
+
+static gboolean on_heartbeat_round(gpointer userdata) {
+    gint64 now = g_get_monotonic_time();
+    struct probe_packet packet = {
+        .magic = htonl(PROBE_MAGIC),
+        .type = htonl(PROBE_HEARTBEAT),
+        .token = htonl(membership_hash(local_client_service.name, 0)),
+    };
+
+    /*
+     * If this daemon did not run for a while, the silence is ours rather
+     * than the peers'; start their timeouts over instead of dropping them
+     */
+    bool stalled = heartbeat.last_round_at &&
+                   now - heartbeat.last_round_at >
+                       2 * HEARTBEAT_INTERVAL_MS * 1000;
+    heartbeat.last_round_at = now;
+    heartbeat.round++;
+    if (stalled) {
+        stats.heartbeat_stalls++;
+    }
+
+    GSequenceIter* iter = g_sequence_get_begin_iter(election.ranking);
+    for (; !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter)) {
+        struct peer* peer = g_sequence_get(iter);
+        struct remote_service* primary = peer->primary;
+        gpointer id = GUINT_TO_POINTER(membership_hash(peer->name, 0));
+        struct heartbeat_peer* hb;
 
-    struct remote_service* best = TAILQ_FIRST(&client_service_list);
+        if (is_own_service(primary) || !primary->has_address) {
+            continue;
+        }
 
-    if (best != NULL && best->host_preference) {
-        if (best->flags & AVAHI_LOOKUP_RESULT_OUR_OWN) {
-            if (other_count) {
-                g_print("This is the best host. Hosting for %i clients....\n",
-                        other_count);
-                host_game(other_count + 1);
-            } else {
-                g_print("No peers found\n");
-                launch_single_player();
+        hb = g_hash_table_lookup(heartbeat.peers, id);
+        if (hb == NULL) {
+            if (g_hash_table_size(heartbeat.peers) >= HEARTBEAT_MAX_PEERS) {
+                continue;
             }
-        } else {
-            g_print("Best host is %s\n", best->hostname);
-            // No change here; wait for the host to start the game
+            hb = g_new0(struct heartbeat_peer, 1);
+            hb->name = g_strdup(peer->name);
+            g_hash_table_insert(heartbeat.peers, id, hb);
         }
-    } else {
-        g_print("No suitable hosts\n");
-        launch_single_player();
+
+        if (!address_to_sockaddr(&primary->address, primary->interface,
+                                 config.probe_port, &hb->sa, &hb->len)) {
+            hb->len = 0;
+        }
+        if (hb->failed_at) {
+            // Discovered again, so it has to answer again before it counts
+            g_print("Client %s is back\n", hb->name);
+            stats.heartbeat_returns++;
+            hb->failed_at = 0;
+            hb->last_heard_at = 0;
+        }
+        hb->round = heartbeat.round;
     }
 
-    timeout_source = 0;
-    return FALSE;
-}
+    GHashTableIter hb_iter;
+    struct heartbeat_peer* hb;
+    GPtrArray* failed = g_ptr_array_new_with_free_func(g_free);
+
+    g_hash_table_iter_init(&hb_iter, heartbeat.peers);
+    while (g_hash_table_iter_next(&hb_iter, NULL, (gpointer*)&hb)) {
+        if (hb->failed_at ? now - hb->failed_at > HEARTBEAT_FORGET_TIME
+                          : hb->round != heartbeat.round) {
+            // Left through mDNS, or gone for good
+            g_hash_table_iter_remove(&hb_iter);
+            continue;
+        }
 
-static int cmp_remote_service(struct remote_service* const a,
-                              struct remote_service* const b) {
-    int ret = a->host_preference - b->host_preference;
-    if (ret) {
-        return ret;
+        if (hb->len && sendto(probe_fd, &packet, sizeof(packet), 0,
+                              (struct sockaddr*)&hb->sa,
+                              hb->len) == sizeof(packet)) {
+            stats.heartbeats_sent++;
+        }
+
+        if (hb->failed_at || !hb->last_heard_at) {
+            continue;
+        }
+        if (stalled) {
+            hb->last_heard_at = now;
+        } else if (now - hb->last_heard_at > HEARTBEAT_TIMEOUT_MS * 1000) {
+            gint64 silence_ms = (now - hb->last_heard_at) / 1000;
+
+            g_print("No heartbeat from %s for %" G_GINT64_FORMAT
+                    " ms, removing it\n",
+                    hb->name, silence_ms);
+            hb->failed_at = now;
+            stats.heartbeat_failures++;
+            stats.heartbeat_detect_max =
+                MAX(stats.heartbeat_detect_max, silence_ms);
+            g_ptr_array_add(failed, g_strdup(hb->name));
+        }
     }
 
-    return g_strcmp0(a->name, b->name);
+    for (guint i = 0; i < failed->len; i++) {
+        remove_failed_peer(g_ptr_array_index(failed, i));
+    }
+    g_ptr_array_unref(failed);
+
+    return G_SOURCE_CONTINUE;
 }
 
-static void handle_collision(struct local_service* service) {
-    /* A service name collision with a remote service
-     * happened. Let's pick a new name */
-    char* n = avahi_alternative_service_name(service->name);
-    avahi_free(service->name);
-    service->name = n;
-    fprintf(stderr, "Service name collision, renaming service to '%s'\n",
-            service->name);
-    /* And recreate the services */
-    create_service(avahi_entry_group_get_client(service->group), service);
-}
-
-static void entry_group_callback(AvahiEntryGroup* group,
-                                 AvahiEntryGroupState state,
-                                 AVAHI_GCC_UNUSED void* userdata) {
-    struct local_service* service = userdata;
-
-    /* Called whenever the entry group state changes */
-    switch (state) {
-        case AVAHI_ENTRY_GROUP_ESTABLISHED:
-            /* The entry group has been established successfully */
-            fprintf(stderr, "Service '%s' successfully established.\n",
-                    service->name);
-            break;
-        case AVAHI_ENTRY_GROUP_COLLISION:
-            handle_collision(service);
-            break;
+static void heartbeat_peer_free(struct heartbeat_peer* hb) {
+    g_free(hb->name);
+    g_free(hb);
+}
 
-        case AVAHI_ENTRY_GROUP_FAILURE:
-            fprintf(stderr, "Entry group failure: %s\n",
-                    avahi_strerror(avahi_client_errno(
-                        avahi_entry_group_get_client(group))));
-            break;
+static void start_heartbeats(void) {
+    heartbeat.peers = g_hash_table_new_full(
+        g_direct_hash, g_direct_equal, NULL,
+        (GDestroyNotify)heartbeat_peer_free);
+    heartbeat.source =
+        g_timeout_add(HEARTBEAT_INTERVAL_MS, on_heartbeat_round, NULL);
+}
 
-        case AVAHI_ENTRY_GROUP_UNCOMMITED:
-        case AVAHI_ENTRY_GROUP_REGISTERING:;
+static void print_stats(void) {
+    backend->print_stats();
+    interfaces_print_stats();
+    g_print("TXT updates applied in place: %u\n", stats.txt_updates);
+    g_print("Invalid TXT records ignored: %u\n", stats.txt_invalid);
+    g_print("Path probes: %u sent, %u replies, %u timeouts\n",
+            stats.probes_sent, stats.probe_replies, stats.probe_timeouts);
+    g_print("RTT probes: %u sent, %u replies, worst RTT %d ms\n",
+            stats.rtt_probes_sent, stats.rtt_replies, local_rtt);
+    g_print("Heartbeats: %u sent, %u received, %u peers declared gone "
+            "(slowest after %" G_GINT64_FORMAT " ms), %u came back, %u "
+            "refreshes, %u stalls\n",
+            stats.heartbeats_sent, stats.heartbeats_received,
+            stats.heartbeat_failures, stats.heartbeat_detect_max,
+            stats.heartbeat_returns, stats.heartbeat_refreshes,
+            stats.heartbeat_stalls);
+    health_print_stats();
+    g_print("Stress updates: %u published, %u held back\n",
+            stats.stress_updates, stats.stress_updates_held);
+    g_print("Matches: %u partitions, %u hosts of other matches ignored\n",
+            stats.partitions, stats.other_match_hosts);
+    g_print("Late joins: %u games kept running, %u late players joined "
+            "(average %" G_GINT64_FORMAT " ms, max %" G_GINT64_FORMAT
+            " ms to play)\n",
+            stats.late_deferred, stats.late_joins,
+            stats.late_joins ? stats.late_wait_total / stats.late_joins / 1000
+                             : 0,
+            stats.late_wait_max / 1000);
+    g_print("Successors: %u took over, %u joined, %u timed out\n",
+            stats.successor_takeovers, stats.successor_joins,
+            stats.successor_timeouts);
+    g_print("Host readiness: %u ready (average %" G_GINT64_FORMAT
+            " ms, max %" G_GINT64_FORMAT " ms after spawn), %u timed out\n",
+            stats.host_ready,
+            stats.host_ready ? stats.host_ready_total / stats.host_ready / 1000
+                             : 0,
+            stats.host_ready_max / 1000, stats.host_ready_timeouts);
+    g_print("Events: %u dirty events, %u dispatches (%.2f events/dispatch)\n",
+            stats.dirty_events, stats.dispatches,
+            stats.dispatches
+                ? (double)stats.dirty_events / stats.dispatches
+                : 0.0);
+    g_print("Election: %u best candidate changes, %u result changes\n",
+            stats.best_changes, stats.result_changes);
+    g_print("Membership digest: %u updates published, %u early starts\n",
+            stats.digest_updates, stats.digest_starts);
+    if (stats.last_change_at) {
+        g_print("Election last changed %" G_GINT64_FORMAT
+                " ms after startup\n",
+                (stats.last_change_at - stats.started_at) / 1000);
+    }
+    if (stats.first_decision_at) {
+        g_print("First election decided %" G_GINT64_FORMAT
+                " ms after startup\n",
+                (stats.first_decision_at - stats.started_at) / 1000);
+    }
+    g_print("Source wait: %u capped at multiplayer.max-wait\n",
+            stats.source_wait_capped);
+    g_print("Host switches avoided: %u\n", stats.host_switches_avoided);
+    if (stats.first_peer_at && stats.game_started_at) {
+        g_print("Multiplayer game started %" G_GINT64_FORMAT
+                " ms after the first peer was seen\n",
+                (stats.game_started_at - stats.first_peer_at) / 1000);
     }
 }
 
-static void create_service(AvahiClient* client, struct local_service* service) {
-    if (service->name == NULL) {
-        sd_id128_t machine_id;
-        sd_id128_get_machine(&machine_id);
-        service->name = g_strdup_printf(SD_ID128_FORMAT_STR,
-                                        SD_ID128_FORMAT_VAL(machine_id));
+/*
+ * Called by the discovery backend when a service instance is resolved, or
+ * re-resolved because its records changed.
+ */
+static void on_service_resolved(struct discovery_record const* record) {
+    struct remote_service* service = remote_service_new(
+        record->name, record->type, record->domain, record->hostname);
+    service->interface = record->interface;
+    service->protocol = record->protocol;
+    service->flags = record->flags;
+    service->port = record->port;
+    if (record->address) {
+        service->has_address = true;
+        service->address = *record->address;
     }
 
-    if (service->group == NULL) {
-        service->group =
-            avahi_entry_group_new(client, entry_group_callback, service);
-        if (service->group == NULL) {
-            g_critical("avahi_entry_group_new() failed: %s\n",
-                       avahi_strerror(avahi_client_errno(client)));
-            return;
-        }
+    struct txt_info info;
+    if (!txt_parse(record->txt, &info)) {
+        g_debug("Service '%s' has too many TXT records\n", record->name);
+    }
+    if (info.invalid) {
+        g_debug("Service '%s' has %u invalid TXT records\n", record->name,
+                info.invalid);
+        stats.txt_invalid += info.invalid;
+    }
+    service->txt_version = info.version;
+    service->host_preference = info.host_preference;
+    service->wad = info.wad;
+    service->wireless = info.wireless;
+    service->score = info.score;
+    service->rtt = info.rtt;
+    service->stressed = info.stressed;
+    service->capacity = info.capacity;
+    service->successor = txt_value_dup(&info.successor);
+    service->network = txt_value_dup(&info.network);
+    service->has_match = info.has_match;
+    service->match = info.match;
+    service->members = txt_value_dup(&info.members);
+    service->has_digest = info.has_digest;
+    service->digest = info.digest;
+
+    struct remote_service* existing =
+        g_hash_table_lookup(remote_services, service);
+    if (existing && g_strcmp0(existing->hostname, service->hostname) == 0) {
+        existing->stale = false;
+        update_remote_service(existing, service);
+        remote_service_free(service);
+        return;
     }
 
-    if (avahi_entry_group_is_empty(service->group)) {
-        g_print("Adding service '%s'\n", service->name);
+    // Replace any existing entry for the same service
+    if (existing) {
+        remove_remote_service(existing);
+    }
 
-        int ret = avahi_entry_group_add_service_strlst(
-            service->group, service->interface, service->protocol,
-            service->flags, service->name, service->type, service->domain,
-            service->host, service->port, service->txt_records);
+    if (is_client_service(service)) {
+        if (!registry_add(service)) {
+            g_print("New path to client %s (interface %d, protocol %d)\n",
+                    service->name, service->interface, service->protocol);
+            return;
+        }
 
-        if (ret != 0) {
-            if (ret == AVAHI_ERR_COLLISION) {
-                avahi_entry_group_reset(service->group);
-                handle_collision(service);
-                return;
-            }
+        g_print("New client %s (%s)\n", service->name, service->hostname);
+        g_print("  host-preference: %d\n", service->host_preference);
+        g_print("  is-own: %s\n",
+                (service->flags & AVAHI_LOOKUP_RESULT_OUR_OWN) ? "true"
+                                                               : "false");
 
-            g_error("Failed to add %s service: %s\n", CLIENT_SERVICE_NAME,
-                    avahi_strerror(ret));
+        // If this is not our own service, restart the source timer
+        if (!is_own_service(service)) {
+            mark_dirty(DIRTY_CLIENTS);
+        }
+    } else if (g_strcmp0(record->type, HOST_SERVICE_NAME) == 0 &&
+               !is_own_service(service)) {
+        registry_add(service);
+        if (current_host && current_host->peer == service->peer) {
+            g_print("New path to host %s (interface %d, protocol %d)\n",
+                    service->name, service->interface, service->protocol);
             return;
         }
 
-        ret = avahi_entry_group_commit(service->group);
-        if (ret != 0) {
-            g_warning("Failed to commit entry group: %s\n",
-                      avahi_strerror(ret));
+        if (!match_accepts(service)) {
+            g_print("Ignoring host %s of another match\n", service->name);
+            stats.other_match_hosts++;
+            return;
         }
-    }
-}
-
-static void resolve_callback(AvahiServiceResolver* r, AvahiIfIndex interface,
-                             AvahiProtocol protocol, AvahiResolverEvent event,
-                             const char* name, const char* type,
-                             const char* domain, const char* host_name,
-                             const AvahiAddress* address, uint16_t port,
-                             AvahiStringList* txt, AvahiLookupResultFlags flags,
-                             AVAHI_GCC_UNUSED void* userdata) {
-    assert(r);
-    /* Called whenever a service has been resolved successfully or timed out
-     */
-    switch (event) {
-        case AVAHI_RESOLVER_FAILURE:
-            g_error(
-                "(Resolver) Failed to resolve service '%s' of type '%s' in "
-                "domain '%s': %s\n",
-                name, type, domain,
-                avahi_strerror(
-                    avahi_client_errno(avahi_service_resolver_get_client(r))));
-            break;
-
-        case AVAHI_RESOLVER_FOUND: {
-            char a[AVAHI_ADDRESS_STR_MAX], *t;
-            g_debug("Service '%s' of type '%s' in domain '%s':\n", name, type,
-                    domain);
-            avahi_address_snprint(a, sizeof(a), address);
-            t = avahi_string_list_to_string(txt);
-            g_debug(
-                "\t%s:%u (%s)\n"
-                "\tTXT=%s\n"
-                "\tcookie is %u\n"
-                "\tis_local: %i\n"
-                "\tour_own: %i\n"
-                "\twide_area: %i\n"
-                "\tmulticast: %i\n"
-                "\tcached: %i\n",
-                host_name, port, a, t,
-                avahi_string_list_get_service_cookie(txt),
-                !!(flags & AVAHI_LOOKUP_RESULT_LOCAL),
-                !!(flags & AVAHI_LOOKUP_RESULT_OUR_OWN),
-                !!(flags & AVAHI_LOOKUP_RESULT_WIDE_AREA),
-                !!(flags & AVAHI_LOOKUP_RESULT_MULTICAST),
-                !!(flags & AVAHI_LOOKUP_RESULT_CACHED));
-            avahi_free(t);
-
-            struct remote_service* service = g_malloc0(sizeof(*service));
-            service->name = g_strdup(name);
-            service->type = g_strdup(type);
-            service->domain = g_strdup(domain);
-            service->hostname = g_strdup(host_name);
-            service->interface = interface;
-            service->protocol = protocol;
-            service->flags = flags;
-            service->port = port;
-
-            while (txt) {
-                char* key;
-                char* value;
-                size_t size;
-                if (avahi_string_list_get_pair(txt, &key, &value, &size)) {
-                    continue;
-                }
-
-                if (g_strcmp0(key, HOST_PREF_KEY) == 0) {
-                    service->host_preference = strtol(value, NULL, 0);
-                } else if (g_strcmp0(key, WAD_KEY) == 0) {
-                    service->wad = g_strdup(value);
-                }
-
-                avahi_free(key);
-                avahi_free(value);
-                txt = avahi_string_list_get_next(txt);
-            }
 
-            if (g_strcmp0(type, CLIENT_SERVICE_NAME) == 0) {
-                // Remove matching entries from client list
-                struct remote_service *c, *tmp_c = NULL;
-                TAILQ_FOREACH_SAFE(c, &client_service_list, link, tmp_c) {
-                    if (remote_service_equal(service, c)) {
-                        g_print("Removing client %s\n", c->name);
-                        TAILQ_REMOVE(&client_service_list, c, link);
-                        remote_service_free(c);
-                    }
-                }
-
-                g_print("New client %s (%s)\n", service->name,
-                        service->hostname);
-                g_print("  host-preference: %d\n", service->host_preference);
-                g_print("  is-own: %s\n",
-                        (service->flags & AVAHI_LOOKUP_RESULT_OUR_OWN)
-                            ? "true"
-                            : "false");
-
-                // Sorted insert
-                TAILQ_FOREACH(c, &client_service_list, link) {
-                    if (cmp_remote_service(service, c) > 0) {
-                        g_print("Adding new client before %s\n", c->name);
-                        TAILQ_INSERT_BEFORE(c, service, link);
-                        break;
-                    }
-                }
-                if (c == NULL) {
-                    g_print("Adding new client to end of list\n");
-                    TAILQ_INSERT_TAIL(&client_service_list, service, link);
-                }
-
-                // If this is not our own service, restart the source timer
-                if ((service->flags & AVAHI_LOOKUP_RESULT_OUR_OWN) == 0) {
-                    restart_source_timer();
-                }
-            } else if (g_strcmp0(type, HOST_SERVICE_NAME) == 0) {
-                if ((service->flags & AVAHI_LOOKUP_RESULT_OUR_OWN) == 0) {
-                    g_print("Connecting to new host %s (%s)\n", service->name,
-                            service->hostname);
-                    remote_service_free(current_host);
-                    current_host = service;
-
-                    connect_to_host();
-
-                    stop_source_timer();
-                } else {
-                    remote_service_free(service);
-                }
-            } else {
-                remote_service_free(service);
+        if (service->members &&
+            !members_contains(service->members, local_client_service.name)) {
+            g_print("Host %s is running a game without us\n", service->name);
+            if (!current_host && !hosting && !late_join.since) {
+                late_join.since = g_get_monotonic_time();
+                late_join.host = g_strdup(service->name);
             }
-        }
-    }
-    avahi_service_resolver_free(r);
-}
-
-static void browse_callback(AvahiServiceBrowser* b, AvahiIfIndex interface,
-                            AvahiProtocol protocol, AvahiBrowserEvent event,
-                            const char* name, const char* type,
-                            const char* domain,
-                            AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
-                            void* userdata) {
-    AvahiClient* c = userdata;
-    assert(b);
-    /* Called whenever a new services becomes available on the LAN or is
-     * removed from the LAN */
-    switch (event) {
-        case AVAHI_BROWSER_FAILURE:
-            g_warning("(Browser) %s\n",
-                      avahi_strerror(avahi_client_errno(
-                          avahi_service_browser_get_client(b))));
             return;
+        }
 
-        case AVAHI_BROWSER_NEW:
-            g_debug("(Browser) NEW: service '%s' of type '%s' in domain '%s'\n",
-                    name, type, domain);
-            /* We ignore the returned resolver object. In the callback
-               function we free it. If the server is terminated before
-               the callback function is called the server will free
-               the resolver for us. */
-            if (!(avahi_service_resolver_new(c, interface, protocol, name, type,
-                                             domain, AVAHI_PROTO_INET, 0,
-                                             resolve_callback, c)))
-                g_warning("Failed to resolve service '%s': %s\n", name,
-                          avahi_strerror(avahi_client_errno(c)));
-            break;
+        g_print("Connecting to new host %s (%s)\n", service->name,
+                service->hostname);
+        cancel_host_probe();
+        current_host = service->peer->primary;
+        mark_dirty(DIRTY_HOST);
+    } else {
+        remote_service_free(service);
+    }
+}
 
-        case AVAHI_BROWSER_REMOVE: {
-            g_debug(
-                "(Browser) REMOVE: service '%s' of type '%s' in domain '%s'\n",
-                name, type, domain);
-            struct remote_service* client;
-            struct remote_service* client_tmp;
-
-            TAILQ_FOREACH_SAFE(client, &client_service_list, link, client_tmp) {
-                if (g_strcmp0(client->name, name) == 0 &&
-                    g_strcmp0(client->type, type) == 0 &&
-                    g_strcmp0(client->domain, domain) == 0) {
-                    if ((client->flags & AVAHI_LOOKUP_RESULT_OUR_OWN) == 0) {
-                        restart_source_timer();
-                    }
-                    g_print("Removing client %s\n", client->name);
-                    TAILQ_REMOVE(&client_service_list, client, link);
-
-                    remote_service_free(client);
-                }
-            }
+/* Called by the discovery backend when a service instance goes away */
+static void on_service_removed(AvahiIfIndex interface, AvahiProtocol protocol,
+                               char const* name, char const* type,
+                               char const* domain) {
+    struct remote_service* service =
+        registry_lookup(name, type, domain, interface, protocol);
 
-            if (current_host && (g_strcmp0(current_host->name, name) == 0) &&
-                (g_strcmp0(current_host->type, type) == 0) &&
-                (g_strcmp0(current_host->domain, domain) == 0)) {
-                remote_service_free(current_host);
-                current_host = NULL;
+    if (service) {
+        remove_remote_service(service);
+    }
+}
 
-                launch_single_player();
-                restart_source_timer();
-            }
-        } break;
+static void on_resync_begin(void) {
+    GHashTableIter iter;
+    struct remote_service* service;
 
-        case AVAHI_BROWSER_ALL_FOR_NOW:
-        case AVAHI_BROWSER_CACHE_EXHAUSTED:
-            g_debug("(Browser) %s\n", event == AVAHI_BROWSER_CACHE_EXHAUSTED
-                                          ? "CACHE_EXHAUSTED"
-                                          : "ALL_FOR_NOW");
-            break;
+    g_hash_table_iter_init(&iter, remote_services);
+    while (g_hash_table_iter_next(&iter, (gpointer*)&service, NULL)) {
+        service->stale = true;
     }
 }
 
-/* Callback for state changes on the Client */
-static void avahi_client_callback(AVAHI_GCC_UNUSED AvahiClient* client,
-                                  AvahiClientState state, void* userdata) {
-    GMainLoop* loop = userdata;
-    g_debug("Avahi Client State Change: %d", state);
-    switch (state) {
-        case AVAHI_CLIENT_S_RUNNING:
-            create_service(client, &local_client_service);
-            break;
+/* Removes the services that were not reported again during the re-sync */
+static void on_resync_end(void) {
+    GHashTableIter iter;
+    struct remote_service* service;
+    GList* stale = NULL;
 
-        case AVAHI_CLIENT_FAILURE:
-            /* We we're disconnected from the Daemon */
-            g_debug("Disconnected from the Avahi Daemon: %s",
-                    avahi_strerror(avahi_client_errno(client)));
-            /* Quit the application */
-            g_main_loop_quit(loop);
-            break;
+    g_hash_table_iter_init(&iter, remote_services);
+    while (g_hash_table_iter_next(&iter, (gpointer*)&service, NULL)) {
+        if (service->stale) {
+            stale = g_list_prepend(stale, service);
+        }
+    }
 
-        default:
-            break;
+    g_print("Re-sync complete, %u services went away\n",
+            g_list_length(stale));
+
+    for (GList* l = stale; l; l = l->next) {
+        remove_remote_service(l->data);
     }
+    g_list_free(stale);
 }
 
+static struct discovery_callbacks const discovery_callbacks = {
+    .resolved = on_service_resolved,
+    .removed = on_service_removed,
+    .interface_allowed = interface_allowed,
+    .resync_begin = on_resync_begin,
+    .resync_end = on_resync_end,
+};
+
 static bool parse_config(int* argc, char*** argv) {
     config.port = 5029;
     config.zdoom = g_strdup(DEFAULT_ZDOOM);
+    config.cache_dir = g_strdup(DEFAULT_CACHE_DIR);
     config.mp_wad = g_strdup(DEFAULT_MP_WAD);
     config.mp_map = g_strdup(DEFAULT_MP_MAP);
     config.mp_config = NULL;
@@ -628,7 +3070,20 @@ static bool parse_config(int* argc, char*** argv) {
     config.sp_config = NULL;
     config.can_host = true;
     config.source_wait = DEFAULT_SOURCE_WAIT;
+    config.source_min_wait = DEFAULT_SOURCE_MIN_WAIT;
+    config.source_max_wait = DEFAULT_SOURCE_MAX_WAIT;
+    config.host_switch_margin = DEFAULT_HOST_SWITCH_MARGIN;
     config.host_preference_override = -1;
+    config.max_resolvers = DEFAULT_MAX_RESOLVERS;
+    config.protocol = AVAHI_PROTO_UNSPEC;
+    config.probe_port = 0;
+    config.low_chatter = false;
+    config.interfaces = NULL;
+    config.ignore_interfaces = NULL;
+    config.interface_priority = NULL;
+    config.backend = NULL;
+    config.dry_run = false;
+    config.late_join = LATE_JOIN_RESTART;
 
     static gchar* config_file_path = DEFAULT_CONFIG_PATH;
 
@@ -637,6 +3092,10 @@ static bool parse_config(int* argc, char*** argv) {
          "Config file path"},
         {"host-preference", 'p', 0, G_OPTION_ARG_INT,
          &config.host_preference_override, "Override host preference"},
+        {"backend", 'b', 0, G_OPTION_ARG_STRING, &config.backend,
+         "Discovery backend (avahi or sim)"},
+        {"dry-run", 'n', 0, G_OPTION_ARG_NONE, &config.dry_run,
+         "Log game launches instead of running zdoom"},
         {},
     };
 
@@ -645,11 +3104,36 @@ static bool parse_config(int* argc, char*** argv) {
     g_autoptr(GError) error = NULL;
 
     g_option_context_add_main_entries(context, entries, NULL);
+    for (size_t i = 0; i < G_N_ELEMENTS(discovery_backends); i++) {
+        if (discovery_backends[i]->option_group) {
+            g_option_context_add_group(context,
+                                       discovery_backends[i]->option_group());
+        }
+    }
     if (!g_option_context_parse(context, argc, argv, &error)) {
         g_print("Unable to parse options: %m");
         return false;
     }
 
+    backend = discovery_backends[0];
+    if (config.backend) {
+        backend = NULL;
+        for (size_t i = 0; i < G_N_ELEMENTS(discovery_backends); i++) {
+            if (g_strcmp0(config.backend, discovery_backends[i]->name) == 0) {
+                backend = discovery_backends[i];
+            }
+        }
+        if (backend == NULL) {
+            g_print("Unknown discovery backend '%s'\n", config.backend);
+            return false;
+        }
+    }
+
+    // Simulated peers cannot play, so never start the game for them
+    if (backend == &discovery_sim) {
+        config.dry_run = true;
+    }
+
     g_autoptr(GKeyFile) key_file = g_key_file_new();
 
     if (!g_key_file_load_from_file(key_file, config_file_path, 0, &error)) {
@@ -664,6 +3148,12 @@ static bool parse_config(int* argc, char*** argv) {
         config.zdoom = value;
     }
 
+    if ((value = g_key_file_get_string(key_file, "global", "cache-dir",
+                                       NULL)) != NULL) {
+        g_free(config.cache_dir);
+        config.cache_dir = value;
+    }
+
     if ((value = g_key_file_get_string(key_file, "multiplayer", "wad", NULL)) !=
         NULL) {
         g_free(config.mp_wad);
@@ -714,6 +3204,73 @@ static bool parse_config(int* argc, char*** argv) {
         config.source_wait = ival;
     }
 
+    ival = g_key_file_get_integer(key_file, "multiplayer", "min-wait", NULL);
+    if (ival > 0) {
+        config.source_min_wait = ival;
+    }
+
+    ival = g_key_file_get_integer(key_file, "multiplayer", "max-wait", NULL);
+    if (ival > 0) {
+        config.source_max_wait = ival;
+    }
+
+    if ((value = g_key_file_get_string(key_file, "multiplayer", "late-join",
+                                       NULL)) != NULL) {
+        bool found = false;
+
+        for (size_t i = 0; i < G_N_ELEMENTS(late_join_policy_names); i++) {
+            if (g_strcmp0(value, late_join_policy_names[i]) == 0) {
+                config.late_join = i;
+                found = true;
+            }
+        }
+        if (!found) {
+            g_warning("Unknown late-join policy '%s'", value);
+        }
+        g_free(value);
+    }
+
+    ival = g_key_file_get_integer(key_file, "multiplayer", "host-switch-margin",
+                                  NULL);
+    if (ival > 0) {
+        config.host_switch_margin = ival;
+    }
+
+    ival =
+        g_key_file_get_integer(key_file, "discovery", "max-resolvers", NULL);
+    if (ival > 0) {
+        config.max_resolvers = ival;
+    }
+
+    if ((value = g_key_file_get_string(key_file, "discovery", "protocol",
+                                       NULL)) != NULL) {
+        if (g_strcmp0(value, "ipv4") == 0) {
+            config.protocol = AVAHI_PROTO_INET;
+        } else if (g_strcmp0(value, "ipv6") == 0) {
+            config.protocol = AVAHI_PROTO_INET6;
+        } else if (g_strcmp0(value, "any") == 0) {
+            config.protocol = AVAHI_PROTO_UNSPEC;
+        } else {
+            g_warning("Unknown discovery protocol '%s'", value);
+        }
+        g_free(value);
+    }
+
+    ival = g_key_file_get_integer(key_file, "discovery", "probe-port", NULL);
+    if (ival > 0) {
+        config.probe_port = ival;
+    }
+
+    config.low_chatter =
+        g_key_file_get_boolean(key_file, "discovery", "low-chatter", NULL);
+
+    config.interfaces = g_key_file_get_string_list(key_file, "discovery",
+                                                   "interfaces", NULL, NULL);
+    config.ignore_interfaces = g_key_file_get_string_list(
+        key_file, "discovery", "ignore-interfaces", NULL, NULL);
+    config.interface_priority = g_key_file_get_string_list(
+        key_file, "discovery", "interface-priority", NULL, NULL);
+
     return true;
 }
 
@@ -750,6 +3307,11 @@ static bool check_has_keyboard(void) {
     return has_keyboard;
 }
 
+static gboolean on_stats_signal(gpointer data) {
+    print_stats();
+    return G_SOURCE_CONTINUE;
+}
+
 static gboolean on_term_signal(gpointer data) {
     GMainLoop* loop = data;
     g_main_loop_quit(loop);
@@ -757,11 +3319,14 @@ static gboolean on_term_signal(gpointer data) {
 }
 
 int main(int argc, char** argv) {
-    int error = 0;
     if (!parse_config(&argc, &argv)) {
         return 1;
     }
 
+    if (!config.probe_port) {
+        config.probe_port = config.port + 1;
+    }
+
     bool has_keyboard = check_has_keyboard();
     int host_preference = 0;
     if (config.host_preference_override >= 0) {
@@ -776,44 +3341,85 @@ int main(int argc, char** argv) {
     }
     g_print("Host preference is %d\n", host_preference);
 
+    // Only a daemon that may host needs to know how well it would do
+    if (host_preference > 0) {
+        struct capability capability;
+
+        capability_measure(config.cache_dir, !config.dry_run, &capability);
+        local_score = capability.score;
+    }
+
     g_autoptr(GMainLoop) loop = g_main_loop_new(NULL, FALSE);
 
+    interfaces_init(config.interfaces, config.ignore_interfaces,
+                    config.interface_priority);
+
+    // Tell Avahi to use glib allocators
+    avahi_set_allocator(avahi_glib_allocator());
+
+    sd_id128_t machine_id;
+    sd_id128_get_machine(&machine_id);
+
     local_client_service.interface = AVAHI_IF_UNSPEC;
-    local_client_service.protocol = AVAHI_PROTO_INET;
+    local_client_service.protocol = config.protocol;
+    local_client_service.name =
+        g_strdup_printf(SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL(machine_id));
     local_client_service.type = CLIENT_SERVICE_NAME;
+    if (config.low_chatter && host_preference > 0) {
+        local_client_service.subtype = HOST_ELIGIBLE_SUBTYPE;
+    }
     local_client_service.port = config.port;
-    local_client_service.txt_records =
-        avahi_string_list_add_printf(local_client_service.txt_records, "%s=%d",
-                                     HOST_PREF_KEY, host_preference);
+    local_host_preference = host_preference;
+    local_wireless = interfaces_local_wireless();
+    interfaces_local_network(local_network, sizeof(local_network));
+    rebuild_client_txt();
 
     local_host_service.interface = AVAHI_IF_UNSPEC;
-    local_host_service.protocol = AVAHI_PROTO_INET;
+    local_host_service.protocol = config.protocol;
+    local_host_service.name = g_strdup(local_client_service.name);
     local_host_service.type = HOST_SERVICE_NAME;
     local_host_service.port = config.port;
-    local_host_service.txt_records = avahi_string_list_add_pair(
-        local_host_service.txt_records, "wad", config.mp_wad);
-
-    // Tell Avahi to use glib allocators
-    avahi_set_allocator(avahi_glib_allocator());
-
-    AvahiGLibPoll* glib_poll = avahi_glib_poll_new(NULL, G_PRIORITY_DEFAULT);
-    AvahiPoll const* poll_api = avahi_glib_poll_get(glib_poll);
-
-    avahi_client =
-        avahi_client_new(poll_api, 0, avahi_client_callback, loop, &error);
 
-    AvahiServiceBrowser* client_browser = avahi_service_browser_new(
-        avahi_client, AVAHI_IF_UNSPEC, AVAHI_PROTO_INET, CLIENT_SERVICE_NAME,
-        NULL, 0, browse_callback, avahi_client);
+    election.ranking = g_sequence_new(NULL);
+    election.result = ELECTION_NO_SUITABLE_HOST;
+    remote_services =
+        g_hash_table_new_full(remote_service_hash, remote_service_equal,
+                              (GDestroyNotify)remote_service_free, NULL);
+    peers = g_hash_table_new_full(peer_hash, peer_equal,
+                                  (GDestroyNotify)peer_free, NULL);
+
+    stats.started_at = g_get_monotonic_time();
+
+    struct discovery_options options = {
+        .protocol = config.protocol,
+        .max_resolvers = config.max_resolvers,
+        .low_chatter = config.low_chatter,
+        .can_host = host_preference > 0,
+    };
+    g_print("Using %s discovery backend\n", backend->name);
+    if (!backend->start(loop, &options, &discovery_callbacks)) {
+        return 1;
+    }
+    backend->publish(&local_client_service);
 
-    AvahiServiceBrowser* host_browser = avahi_service_browser_new(
-        avahi_client, AVAHI_IF_UNSPEC, AVAHI_PROTO_INET, HOST_SERVICE_NAME,
-        NULL, 0, browse_callback, avahi_client);
+    // Simulated peers have made up addresses, so they are not probed
+    if (open_probe_socket() && !config.dry_run) {
+        start_heartbeats();
+        if (host_preference > 0) {
+            start_rtt_probes();
+        }
+    }
+    // An explicit preference is left alone
+    if (host_preference > 0 && config.host_preference_override < 0) {
+        g_timeout_add_seconds(HEALTH_CHECK_INTERVAL, on_health_check, NULL);
+    }
+    load_peer_cache();
 
     launch_single_player();
 
     g_unix_signal_add(SIGINT, on_term_signal, loop);
     g_unix_signal_add(SIGTERM, on_term_signal, loop);
+    g_unix_signal_add(SIGUSR1, on_stats_signal, NULL);
 
     g_main_loop_run(loop);
 
@@ -823,11 +3429,30 @@ int main(int argc, char** argv) {
     stop_service(&local_host_service);
 
     kill_child();
+    print_stats();
+
+    backend->stop();
+
+    g_hash_table_destroy(remote_services);
+    g_hash_table_destroy(peers);
 
-    avahi_service_browser_free(host_browser);
-    avahi_service_browser_free(client_browser);
-    avahi_client_free(avahi_client);
-    avahi_glib_poll_free(glib_poll);
+    if (probe_fd >= 0) {
+        close(probe_fd);
+    }
+    if (rtt_probe.source) {
+        g_source_remove(rtt_probe.source);
+    }
+    g_clear_pointer(&rtt_probe.names, g_ptr_array_unref);
+    if (heartbeat.source) {
+        g_source_remove(heartbeat.source);
+    }
+    if (host_ready.source) {
+        g_source_remove(host_ready.source);
+    }
+    g_clear_pointer(&heartbeat.peers, g_hash_table_destroy);
+    g_sequence_free(election.ranking);
+    remote_service_pool_clear();
+    interfaces_cleanup();
 
     return 0;
 }
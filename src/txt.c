@@ -0,0 +1,201 @@
+/*
+ * SPDX-License-Identifier: MIT
+ * Copyright Joshua Watt <JPEWhacker@gmail.com>
+ */
+
+#include <glib.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "txt.h"
+
+static bool key_is(char const* key, size_t len, char const* name) {
+    return strlen(name) == len && memcmp(key, name, len) == 0;
+}
+
+/* Parses a decimal integer that must fill the whole value */
+static bool parse_int(char const* value, size_t len, int* out) {
+    bool negative = false;
+    long result = 0;
+    size_t i = 0;
+
+    if (len && value[0] == '-') {
+        negative = true;
+        i++;
+    }
+
+    if (i == len) {
+        return false;
+    }
+
+    for (; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9') {
+            return false;
+        }
+        result = result * 10 + (value[i] - '0');
+        if (result > INT_MAX) {
+            return false;
+        }
+    }
+
+    *out = negative ? -(int)result : (int)result;
+    return true;
+}
+
+/* Parses exactly eight hex digits */
+static bool parse_hex32(char const* value, size_t len, uint32_t* out) {
+    uint32_t result = 0;
+
+    if (len != 8) {
+        return false;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        int digit = g_ascii_xdigit_value(value[i]);
+        if (digit < 0) {
+            return false;
+        }
+        result = (result << 4) | digit;
+    }
+
+    *out = result;
+    return true;
+}
+
+uint32_t membership_hash(char const* name, int host_preference) {
+    // 32 bit FNV-1a, so every daemon computes the same value
+    uint32_t h = 2166136261u;
+
+    for (; *name; name++) {
+        h = (h ^ (uint8_t)*name) * 16777619u;
+    }
+    h = (h ^ (uint32_t)host_preference) * 16777619u;
+    return h;
+}
+
+bool members_contains(char const* members, char const* name) {
+    char hash[9];
+    size_t len;
+
+    snprintf(hash, sizeof(hash), "%08x", membership_hash(name, 0));
+    len = strlen(hash);
+
+    for (char const* p = members; p && *p; p = strchr(p, ',')) {
+        if (*p == ',') {
+            p++;
+        }
+        if (strncmp(p, hash, len) == 0 && (p[len] == ',' || p[len] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool valid_string(char const* value, size_t len) {
+    return len != 0 && memchr(value, '\0', len) == NULL;
+}
+
+/* Interns a WAD name; interned strings are never freed, so they are capped */
+static bool parse_wad(char const* value, size_t len, char const** out) {
+    char buf[TXT_MAX_WAD_NAME + 1];
+
+    if (!valid_string(value, len) || len > TXT_MAX_WAD_NAME) {
+        return false;
+    }
+
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+    *out = g_intern_string(buf);
+    return true;
+}
+
+static bool parse_value(char const* value, size_t len, struct txt_value* out) {
+    if (!valid_string(value, len)) {
+        return false;
+    }
+
+    out->data = value;
+    out->len = len;
+    return true;
+}
+
+char* txt_value_dup(struct txt_value const* value) {
+    return value->data ? g_strndup(value->data, value->len) : NULL;
+}
+
+bool txt_parse(AvahiStringList* txt, struct txt_info* info) {
+    int count = 0;
+
+    memset(info, 0, sizeof(*info));
+
+    for (; txt; txt = avahi_string_list_get_next(txt)) {
+        if (count++ == TXT_MAX_RECORDS) {
+            return false;
+        }
+
+        char const* text = (char const*)avahi_string_list_get_text(txt);
+        size_t size = avahi_string_list_get_size(txt);
+        char const* eq = size ? memchr(text, '=', size) : NULL;
+
+        if (eq == NULL || eq == text || size > TXT_MAX_RECORD_SIZE) {
+            info->invalid++;
+            continue;
+        }
+
+        size_t key_len = eq - text;
+        char const* value = eq + 1;
+        size_t value_len = size - key_len - 1;
+        bool ok = true;
+        int n;
+
+        if (key_is(text, key_len, HOST_PREF_KEY)) {
+            ok = parse_int(value, value_len, &info->host_preference);
+        } else if (key_is(text, key_len, WAD_KEY)) {
+            ok = parse_wad(value, value_len, &info->wad);
+        } else if (key_is(text, key_len, SUCCESSOR_KEY)) {
+            ok = parse_value(value, value_len, &info->successor);
+        } else if (key_is(text, key_len, NETWORK_KEY)) {
+            ok = parse_value(value, value_len, &info->network);
+        } else if (key_is(text, key_len, MEMBERS_KEY)) {
+            ok = parse_value(value, value_len, &info->members);
+        } else if (key_is(text, key_len, MATCH_KEY)) {
+            ok = parse_hex32(value, value_len, &info->match);
+            info->has_match = ok;
+        } else if (key_is(text, key_len, STRESSED_KEY)) {
+            ok = parse_int(value, value_len, &n) && (n == 0 || n == 1);
+            info->stressed = ok && n;
+        } else if (key_is(text, key_len, LINK_KEY)) {
+            info->wireless = key_is(value, value_len, LINK_WIRELESS);
+        } else if (key_is(text, key_len, CAPACITY_KEY)) {
+            ok = parse_int(value, value_len, &n) && n >= 0;
+            if (ok) {
+                info->capacity = n;
+            }
+        } else if (key_is(text, key_len, SCORE_KEY)) {
+            ok = parse_int(value, value_len, &n) && n >= 0;
+            if (ok) {
+                info->score = n;
+            }
+        } else if (key_is(text, key_len, RTT_KEY)) {
+            ok = parse_int(value, value_len, &n) && n >= 0;
+            if (ok) {
+                info->rtt = n;
+            }
+        } else if (key_is(text, key_len, DIGEST_KEY)) {
+            ok = parse_hex32(value, value_len, &info->digest);
+            info->has_digest = ok;
+        } else if (key_is(text, key_len, TXT_VERSION_KEY)) {
+            ok = parse_int(value, value_len, &n) && n >= 0;
+            if (ok) {
+                info->version = n;
+            }
+        }
+
+        if (!ok) {
+            info->invalid++;
+        }
+    }
+
+    return true;
+}
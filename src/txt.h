@@ -0,0 +1,111 @@
+/*
+ * SPDX-License-Identifier: MIT
+ * Copyright Joshua Watt <JPEWhacker@gmail.com>
+ */
+
+#ifndef TXT_H
+#define TXT_H
+
+#include <avahi-common/strlst.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * TXT record schema shared by the client and host services. Every record is
+ * a key=value pair. Daemons advertise the schema version they speak in
+ * TXT_VERSION_KEY; a missing version means the original, unversioned
+ * records (pref and wad only). Unknown keys are ignored, so new fields can be
+ * added without bumping the version as long as their absence is harmless.
+ */
+#define TXT_VERSION (1)
+
+#define TXT_VERSION_KEY "v"
+#define HOST_PREF_KEY "pref"
+#define WAD_KEY "wad"
+#define LINK_KEY "link"
+#define CAPACITY_KEY "cap"
+#define DIGEST_KEY "md"
+#define SCORE_KEY "score"
+#define RTT_KEY "rtt"
+#define SUCCESSOR_KEY "succ"
+#define NETWORK_KEY "net"
+#define MATCH_KEY "match"
+#define MEMBERS_KEY "members"
+#define STRESSED_KEY "stressed"
+
+#define LINK_WIRED "wired"
+#define LINK_WIRELESS "wireless"
+
+// Records beyond this are ignored; a real daemon sends a handful
+#define TXT_MAX_RECORDS (32)
+// A single DNS TXT string is at most 255 bytes
+#define TXT_MAX_RECORD_SIZE (255)
+// WAD names are interned, so only short ones are accepted
+#define TXT_MAX_WAD_NAME (64)
+
+/*
+ * A string value inside the parsed TXT list, not NUL terminated. data is
+ * NULL if the key was not advertised.
+ */
+struct txt_value {
+    char const* data;
+    size_t len;
+};
+
+struct txt_info {
+    int version;
+    int host_preference;
+    // Interned, NULL if not advertised. There are only a handful of WADs,
+    // while the other string values change with every game
+    char const* wad;
+    bool wireless;
+    // Capability benchmark score, 0 if not advertised
+    int score;
+    // Worst round trip time to the other peers in ms, 0 if not advertised
+    int rtt;
+    // The daemon's board is too hot, throttled or loaded to host well
+    bool stressed;
+    // Players the daemon can host, 0 if not advertised
+    int capacity;
+    // Name of the peer that takes over hosting
+    struct txt_value successor;
+    // IPv4 network the daemon sits on
+    struct txt_value network;
+    // Match the host runs when the peers are split into several games
+    bool has_match;
+    uint32_t match;
+    // Players in the host's running game, see members_contains()
+    struct txt_value members;
+    // Membership digest of the daemon's view, see membership_hash()
+    bool has_digest;
+    uint32_t digest;
+    // Records that were malformed or had an invalid value
+    unsigned invalid;
+};
+
+/*
+ * Parses a TXT record list in a single pass without allocating. Malformed
+ * records are counted and skipped. Returns false if the list was cut short
+ * at TXT_MAX_RECORDS. String values point into txt.
+ */
+bool txt_parse(AvahiStringList* txt, struct txt_info* info);
+
+// Returns a newly allocated copy of a string value, NULL if not advertised
+char* txt_value_dup(struct txt_value const* value);
+
+/*
+ * A daemon's membership digest is the XOR of membership_hash() over every
+ * client peer in its view, including itself. Daemons that see the same
+ * peers with the same host preferences advertise the same digest, as eight
+ * lower case hex digits.
+ */
+uint32_t membership_hash(char const* name, int host_preference);
+
+/*
+ * A host advertises the players of its running game as a comma separated
+ * list of membership_hash(name, 0), eight lower case hex digits each.
+ */
+bool members_contains(char const* members, char const* name);
+
+#endif
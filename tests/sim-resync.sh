@@ -0,0 +1,19 @@
+#!/bin/sh
+# SPDX-License-Identifier: MIT
+#
+# Runs the simulator with periodic re-syncs and checks that the daemon's
+# re-sync handling (dropping whatever was not reported again) never drops a
+# peer that is still present. The simulator reports every peer synchronously,
+# so this does not cover how the avahi backend reports services again.
+set -e
+
+launcher="$1"
+output=$("$launcher" --backend=sim --sim-peers=64 --sim-resync=1 \
+    --sim-duration=4 2>&1)
+
+resyncs=$(echo "$output" | grep -c "^Re-sync complete" || true)
+dropped=$(echo "$output" | grep "^Re-sync complete" |
+    grep -vc "^Re-sync complete, 0 services went away" || true)
+
+echo "$resyncs re-syncs, $dropped dropped live services"
+[ "$resyncs" -gt 0 ] && [ "$dropped" -eq 0 ]